@@ -147,6 +147,8 @@ function M.fill_defaulf_params(params)
 
 	if M.platform.is_desktop then
 		M.params.async_encoding = params.async_encoding or false
+		-- With the default GPU conversion frames are planar and masked, enhancement layer frames must not chain masks.
+		M.params.temporal_layers = params.temporal_layers or false
 	end
 	return params
 end
@@ -1,3 +1,22 @@
-class dmBuffer {
-    typedef struct Buffer* HBuffer; 
+#ifndef dmsdk_buffer_h
+#define dmsdk_buffer_h
+
+#include <stdint.h>
+
+namespace dmBuffer {
+	typedef struct Buffer* HBuffer;
+	typedef enum Result {
+		RESULT_OK,
+		RESULT_GUARD_INVALID,
+		RESULT_ALLOCATION_ERROR,
+		RESULT_BUFFER_INVALID,
+		RESULT_BUFFER_SIZE_ERROR,
+		RESULT_STREAM_SIZE_ERROR,
+		RESULT_STREAM_MISSING,
+		RESULT_STREAM_TYPE_MISMATCH,
+		RESULT_STREAM_COUNT_MISMATCH
+	} Result;
+	Result GetBytes(HBuffer buffer, void **out_bytes, uint32_t *out_size);
 };
+
+#endif
@@ -39,6 +39,11 @@ namespace dmScript {
 	void SetInstance(lua_State *L);
 	int Ref(lua_State *L, int table);
 	int Unref(lua_State *L, int table, int reference);
+	struct LuaHBuffer {
+		dmBuffer::HBuffer m_Buffer;
+		bool m_UseLuaGC;
+	};
+	LuaHBuffer *CheckBuffer(lua_State *L, int index);
 };
 
 namespace dmGraphics {
@@ -1049,7 +1049,7 @@ void thread_atomic_int_store( thread_atomic_int_t* atomic, int desired )
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined( __EMSCRIPTEN__ )
 
         __sync_lock_test_and_set( &atomic->i, desired );
-        __sync_lock_release( &atomic->i );
+        __sync_synchronize(); // __sync_lock_release() would reset the value to 0.
     
     #else 
         #error Unknown platform.
@@ -1130,7 +1130,7 @@ int thread_atomic_int_swap( thread_atomic_int_t* atomic, int desired )
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined( __EMSCRIPTEN__ )
 
         int old = (int)__sync_lock_test_and_set( &atomic->i, desired );
-        __sync_lock_release( &atomic->i );
+        __sync_synchronize(); // __sync_lock_release() would reset the value to 0.
         return old;
     
     #else 
@@ -1186,7 +1186,7 @@ void thread_atomic_ptr_store( thread_atomic_ptr_t* atomic, void* desired )
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined( __EMSCRIPTEN__ )
 
         __sync_lock_test_and_set( &atomic->ptr, desired );
-        __sync_lock_release( &atomic->ptr );
+        __sync_synchronize(); // __sync_lock_release() would reset the value to 0.
     
     #else 
         #error Unknown platform.
@@ -1208,7 +1208,7 @@ void* thread_atomic_ptr_swap( thread_atomic_ptr_t* atomic, void* desired )
     #elif defined( __linux__ ) || defined( __APPLE__ ) || defined( __ANDROID__ ) || defined( __EMSCRIPTEN__ )
 
         void* old = __sync_lock_test_and_set( &atomic->ptr, desired );
-        __sync_lock_release( &atomic->ptr );
+        __sync_synchronize(); // __sync_lock_release() would reset the value to 0.
         return old;
     
     #else 
@@ -1449,6 +1449,9 @@ int thread_queue_count( thread_queue_t* queue )
 
 /*
 revision history:
+    local   atomic store and swap on GCC/Clang platforms follow __sync_lock_test_and_set() with 
+            __sync_synchronize() instead of __sync_lock_release(), which stored 0 right after the new 
+            value, so stores were lost and swaps left 0 behind.
     0.3     set_high_priority API change. Fixed spurious wakeup bug in signal. Added 
             timeout param to queue produce/consume. Various cleanup and trivial fixes.
     0.2     first publicly released version 
@@ -1,87 +1,408 @@
 #if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS) || defined(DM_PLATFORM_HTML5)
 
 #include <memory>
+#include <string.h>
+#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX)
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <unistd.h>
+#endif
 
 #include "circular_buffer.h"
 #include "utils.h"
 
 CircularBuffer::CircularBuffer() :
-	buffer(NULL),
+	pages(NULL),
+	max_pages(0),
+	page_start(0),
+	page_count(0),
+	page_size(0),
+	free_pages(NULL),
+	free_page_count(0),
+	allocated_pages(0),
+	peak_pages(0),
+	mapping(NULL),
+	mapping_size(0),
+	mapped_slots(NULL),
+	mapped_slot_count(0),
 	pointers(NULL),
 	sizes(NULL),
 	timestamps(NULL),
 	is_keyframes(NULL),
-	buffer_size(0),
 	count(0),
+	duration(0),
 	index(0),
-	is_full(false),
 	index_start(0),
-	current_pointer(NULL) {
-	}
-
-bool CircularBuffer::init(size_t buffer_size, uint32_t count) {
-	this->buffer_size = buffer_size;
-	this->count = count;
-	buffer = new uint8_t[buffer_size];
-	pointers = new uint8_t*[count];
-	sizes = new size_t[count];
-	timestamps = new int64_t[count];
-	is_keyframes = new bool[count];
-	current_pointer = buffer;
-	if (buffer == NULL || pointers == NULL || sizes == NULL || timestamps == NULL || is_keyframes == NULL) {
+	current_pointer(NULL),
+	frame_count(0),
+	first_sequence(0),
+	keyframes(NULL),
+	keyframe_slots(0),
+	keyframe_start(0),
+	keyframe_count(0),
+	is_keyframe_needed(false) {
+	}
+
+bool CircularBuffer::init(size_t memory_limit, size_t page_size, int64_t duration, const char *filename) {
+	this->page_size = page_size;
+	this->duration = duration;
+	max_pages = memory_limit / page_size;
+	if (max_pages < 2) {
+		max_pages = 2;
+	}
+	pages = new uint8_t*[max_pages];
+	free_pages = new uint8_t*[SPARE_PAGES];
+	if (pages == NULL || free_pages == NULL) {
+		return false;
+	}
+	if (filename != NULL) {
+		if (!map_file(filename, max_pages * page_size)) {
+			return false;
+		}
+		// Pages are slots of the file, the first pages are taken first.
+		mapped_slots = new uint8_t*[max_pages];
+		if (mapped_slots == NULL) {
+			return false;
+		}
+		for (uint32_t i = 0; i < max_pages; ++i) {
+			mapped_slots[mapped_slot_count++] = mapping + (max_pages - 1 - i) * page_size;
+		}
+	}
+	if (!add_page(false) || !grow() || !grow_keyframes()) {
 		return false;
 	}
 	return true;
 }
 
 CircularBuffer::~CircularBuffer() {
-	delete []buffer;
+	if (mapping != NULL) {
+		unmap_file();
+	} else {
+		for (uint32_t i = 0; i < page_count; ++i) {
+			delete []get_page(i);
+		}
+		for (uint32_t i = 0; i < free_page_count; ++i) {
+			delete []free_pages[i];
+		}
+	}
+	delete []pages;
+	delete []free_pages;
+	delete []mapped_slots;
+	delete []pointers;
+	delete []sizes;
+	delete []timestamps;
+	delete []is_keyframes;
+	delete []keyframes;
+}
+
+// Map a file of the given size into memory, an existing file is overwritten. Handles are closed right away, the
+// mapping keeps the file open.
+bool CircularBuffer::map_file(const char *filename, size_t size) {
+	#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX)
+		int file = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if (file == -1) {
+			dmLogError("Failed to open replay file %s.", filename);
+			return false;
+		}
+		if (ftruncate(file, size) != 0) {
+			dmLogError("Failed to resize replay file %s to %zu bytes.", filename, size);
+			close(file);
+			return false;
+		}
+		void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		close(file);
+		if (memory == MAP_FAILED) {
+			dmLogError("Failed to map replay file %s.", filename);
+			return false;
+		}
+		mapping = (uint8_t *)memory;
+		mapping_size = size;
+		return true;
+	#elif defined(DM_PLATFORM_WINDOWS)
+		HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY, NULL);
+		if (file == INVALID_HANDLE_VALUE) {
+			dmLogError("Failed to open replay file %s.", filename);
+			return false;
+		}
+		HANDLE file_mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, NULL);
+		CloseHandle(file);
+		if (file_mapping == NULL) {
+			dmLogError("Failed to create mapping of replay file %s.", filename);
+			return false;
+		}
+		void *memory = MapViewOfFile(file_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+		CloseHandle(file_mapping);
+		if (memory == NULL) {
+			dmLogError("Failed to map replay file %s.", filename);
+			return false;
+		}
+		mapping = (uint8_t *)memory;
+		mapping_size = size;
+		return true;
+	#else
+		(void)size;
+		dmLogError("Replay file %s is not supported on this platform.", filename);
+		return false;
+	#endif
+}
+
+void CircularBuffer::unmap_file() {
+	#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX)
+		munmap(mapping, mapping_size);
+	#elif defined(DM_PLATFORM_WINDOWS)
+		UnmapViewOfFile(mapping);
+	#endif
+	mapping = NULL;
+}
+
+uint8_t *CircularBuffer::allocate_page() {
+	if (mapping != NULL) {
+		return mapped_slot_count > 0 ? mapped_slots[--mapped_slot_count] : NULL;
+	}
+	return new uint8_t[page_size];
+}
+
+// Contents of evicted pages of the file are not needed anymore. Where the file system supports it the page is
+// punched out of the file, so it is neither kept in the page cache nor written back. Otherwise it is only removed
+// from the process, dirty data is still written back by the OS. On Windows the view is left as is, the OS trims it.
+void CircularBuffer::free_page(uint8_t *page) {
+	if (mapping == NULL) {
+		delete []page;
+		return;
+	}
+	#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX)
+		#ifdef MADV_REMOVE
+			if (madvise(page, page_size, MADV_REMOVE) != 0) {
+				madvise(page, page_size, MADV_DONTNEED);
+			}
+		#else
+			madvise(page, page_size, MADV_DONTNEED);
+		#endif
+	#endif
+	mapped_slots[mapped_slot_count++] = page;
+}
+
+// Page in use, 0 is the oldest one.
+uint8_t *CircularBuffer::get_page(uint32_t page) {
+	return pages[(page_start + page) % max_pages];
+}
+
+bool CircularBuffer::is_in_page(uint8_t *data, size_t size, uint8_t *page) {
+	return data >= page && data + size <= page + page_size;
+}
+
+// Continue writing on a new page, taken from the pool or allocated under the memory limit. At the limit the oldest
+// GOPs are evicted to free a page if allowed.
+bool CircularBuffer::add_page(bool is_evicting) {
+	if (free_page_count == 0 && allocated_pages == max_pages) {
+		if (!is_evicting) {
+			return false;
+		}
+		while (free_page_count == 0) {
+			if (page_count == 1) {
+				// Only the page being written is left, start it over.
+				while (frame_count > 0) {
+					evict_gop();
+				}
+				current_pointer = get_page(0);
+				return true;
+			}
+			evict_gop();
+			release_pages();
+		}
+	}
+	uint8_t *page = NULL;
+	if (free_page_count > 0) {
+		page = free_pages[--free_page_count];
+	} else {
+		page = allocate_page();
+		if (page == NULL) {
+			return false;
+		}
+		++allocated_pages;
+		if (allocated_pages > peak_pages) {
+			peak_pages = allocated_pages;
+		}
+	}
+	pages[(page_start + page_count) % max_pages] = page;
+	++page_count;
+	current_pointer = page;
+	return true;
+}
+
+// Return the oldest pages no stored frame is on to the pool, pages over the spare count are freed.
+void CircularBuffer::release_pages() {
+	while (page_count > 1 && (frame_count == 0 || !is_in_page(pointers[index_start], 0, get_page(0)))) {
+		uint8_t *page = get_page(0);
+		if (free_page_count < SPARE_PAGES) {
+			free_pages[free_page_count++] = page;
+		} else {
+			free_page(page);
+			--allocated_pages;
+		}
+		page_start = (page_start + 1) % max_pages;
+		--page_count;
+	}
+}
+
+// Double the frame slots, stored frames move to the start of the new arrays.
+bool CircularBuffer::grow() {
+	uint32_t new_count = count > 0 ? 2 * count : INITIAL_FRAME_SLOTS;
+	uint8_t **new_pointers = new uint8_t*[new_count];
+	size_t *new_sizes = new size_t[new_count];
+	int64_t *new_timestamps = new int64_t[new_count];
+	bool *new_is_keyframes = new bool[new_count];
+	if (new_pointers == NULL || new_sizes == NULL || new_timestamps == NULL || new_is_keyframes == NULL) {
+		delete []new_pointers;
+		delete []new_sizes;
+		delete []new_timestamps;
+		delete []new_is_keyframes;
+		return false;
+	}
+	for (uint32_t i = 0; i < frame_count; ++i) {
+		uint32_t j = (index_start + i) % count;
+		new_pointers[i] = pointers[j];
+		new_sizes[i] = sizes[j];
+		new_timestamps[i] = timestamps[j];
+		new_is_keyframes[i] = is_keyframes[j];
+	}
 	delete []pointers;
 	delete []sizes;
 	delete []timestamps;
 	delete []is_keyframes;
+	pointers = new_pointers;
+	sizes = new_sizes;
+	timestamps = new_timestamps;
+	is_keyframes = new_is_keyframes;
+	count = new_count;
+	index_start = 0;
+	index = frame_count;
+	return true;
+}
+
+// Double the keyframe index slots.
+bool CircularBuffer::grow_keyframes() {
+	uint32_t new_slots = keyframe_slots > 0 ? 2 * keyframe_slots : INITIAL_KEYFRAME_SLOTS;
+	uint32_t *new_keyframes = new uint32_t[new_slots];
+	if (new_keyframes == NULL) {
+		return false;
+	}
+	for (uint32_t i = 0; i < keyframe_count; ++i) {
+		new_keyframes[i] = keyframes[(keyframe_start + i) % keyframe_slots];
+	}
+	delete []keyframes;
+	keyframes = new_keyframes;
+	keyframe_slots = new_slots;
+	keyframe_start = 0;
+	return true;
+}
+
+// Frame index from the oldest stored frame of the n-th stored keyframe.
+uint32_t CircularBuffer::get_keyframe_index(uint32_t keyframe) {
+	return keyframes[(keyframe_start + keyframe) % keyframe_slots] - first_sequence;
+}
+
+// Discard the oldest keyframe and the frames up to the next one.
+void CircularBuffer::evict_gop() {
+	uint32_t evicted = keyframe_count > 1 ? get_keyframe_index(1) : frame_count;
+	index_start = (index_start + evicted) % count;
+	frame_count -= evicted;
+	first_sequence += evicted;
+	if (keyframe_count > 0) {
+		keyframe_start = (keyframe_start + 1) % keyframe_slots;
+		--keyframe_count;
+	}
+}
+
+// Discard GOPs older than the time window. The GOP the window starts in is kept, so the clip always starts with a
+// keyframe at or before the window start.
+void CircularBuffer::evict_expired_frames(int64_t start_timestamp) {
+	while (keyframe_count > 1 && timestamps[(index_start + get_keyframe_index(1)) % count] <= start_timestamp) {
+		evict_gop();
+	}
 }
 
+// Frames after a lost frame can't be played, they are dropped until the next keyframe. The encoder should check
+// needs_keyframe() after each frame and force one.
 bool CircularBuffer::add_frame(uint8_t *data, size_t size, int64_t timestamp, bool is_keyframe) {
-	uint8_t *destination = current_pointer;
-	if (is_full) {
-		// Advance tail.
-		index_start = (index + 1) % count;
-	}
-	if (destination + size >= buffer + buffer_size) {
-		//dmLogDebug("Buffer reset on index %d", index);
-		// Reset to buffer start if out of buffer range.
-		destination = buffer;
-	}
-	if (is_full) {
-		// Discard any tail frames that overlap the new frame.
-		while (
-			(destination <= pointers[index_start] && destination + size >= pointers[index_start]) ||
-			(destination >= pointers[index_start] && pointers[index_start] + sizes[index_start] >= destination)
-		) {
-			index_start = (index_start + 1) % count;
-		}
-	}
-	memcpy(destination, data, size);
-	current_pointer = destination + size;
-	pointers[index] = destination;
+	if (!is_keyframe && is_keyframe_needed) {
+		return true;
+	}
+	if (size > page_size) {
+		is_keyframe_needed = true;
+		return false;
+	}
+	if (!is_in_page(current_pointer, size, get_page(page_count - 1)) && !add_page(true)) {
+		is_keyframe_needed = true;
+		return false;
+	}
+	if (frame_count == 0 && !is_keyframe) {
+		// The memory limit evicted the frame's own GOP to make room for it.
+		is_keyframe_needed = true;
+		return true;
+	}
+	if ((frame_count == count && !grow()) || (is_keyframe && keyframe_count == keyframe_slots && !grow_keyframes())) {
+		is_keyframe_needed = true;
+		return false;
+	}
+	memcpy(current_pointer, data, size);
+	pointers[index] = current_pointer;
 	sizes[index] = size;
 	timestamps[index] = timestamp;
 	is_keyframes[index] = is_keyframe;
-	++index;
-	if (index == count) {
-		index = 0;
-		is_full = true;
+	current_pointer += size;
+	if (is_keyframe) {
+		keyframes[(keyframe_start + keyframe_count) % keyframe_slots] = first_sequence + frame_count;
+		++keyframe_count;
+		is_keyframe_needed = false;
+	}
+	++frame_count;
+	index = (index + 1) % count;
+	evict_expired_frames(timestamp - duration);
+	release_pages();
+	return true;
+}
+
+// Whether frames are being dropped until the next keyframe.
+bool CircularBuffer::needs_keyframe() {
+	return is_keyframe_needed;
+}
+
+// Timestamp the time window ending at end_timestamp starts at. The recording may end later than the newest stored
+// frame, e.g. on static frames that were not encoded.
+int64_t CircularBuffer::get_window_start(int64_t end_timestamp) {
+	return end_timestamp - duration;
+}
+
+// Index of the newest keyframe at or before the timestamp, or of the oldest keyframe if they are all later. A window
+// start in the oldest GOP is found right away, other timestamps are binary searched in the keyframe index.
+bool CircularBuffer::find_keyframe(int64_t timestamp, uint32_t *frame_index) {
+	if (keyframe_count == 0) {
+		return false;
+	}
+	if (keyframe_count == 1 || timestamps[(index_start + get_keyframe_index(1)) % count] > timestamp) {
+		*frame_index = 0;
+		return true;
+	}
+	uint32_t first = 1;
+	uint32_t last = keyframe_count - 1;
+	while (first < last) {
+		uint32_t middle = (first + last + 1) / 2;
+		if (timestamps[(index_start + get_keyframe_index(middle)) % count] <= timestamp) {
+			first = middle;
+		} else {
+			last = middle - 1;
+		}
 	}
+	*frame_index = get_keyframe_index(first);
 	return true;
 }
 
 bool CircularBuffer::get_frame(uint8_t **data, size_t *size, int64_t *timestamp, bool *is_keyframe, uint32_t *frame_index) {
-	uint32_t i = (index_start + *frame_index) % count;
-	// Exit when looped and returned back to index_start or reached current index in case of short video.
-	if (*frame_index > 0 && ((is_full && i == index_start) || (!is_full && i == index))) {
+	if (*frame_index >= frame_count) {
 		return false;
 	}
+	uint32_t i = (index_start + *frame_index) % count;
 	*data = pointers[i];
 	*size = sizes[i];
 	*timestamp = timestamps[i];
@@ -90,4 +411,12 @@ bool CircularBuffer::get_frame(uint8_t **data, size_t *size, int64_t *timestamp,
 	return true;
 }
 
-#endif
\ No newline at end of file
+size_t CircularBuffer::get_memory_size() {
+	return allocated_pages * page_size;
+}
+
+size_t CircularBuffer::get_peak_memory_size() {
+	return peak_pages * page_size;
+}
+
+#endif
@@ -4,25 +4,83 @@
 #include <stdint.h>
 #include <stddef.h>
 
+static const uint32_t INITIAL_FRAME_SLOTS = 256;
+static const uint32_t INITIAL_KEYFRAME_SLOTS = 16;
+// Released pages kept for reuse, the rest are freed.
+static const uint32_t SPARE_PAGES = 2;
+
+// Ring of compressed frames covering the last duration milliseconds, counted back from the newest frame. Frames are
+// copied in by add_frame().
+// Frames are evicted a GOP at a time, a keyframe together with the frames that depend on it, so the oldest stored
+// frame is always a keyframe.
+// Frames are stored in fixed-size pages, each frame within a single page. Pages are allocated as frames arrive up to
+// the memory limit, then the oldest GOPs are evicted to reuse their pages. Pages emptied by eviction return to a
+// small pool. File-backed pages that are freed are punched out of the file where the platform supports it.
 class CircularBuffer {
 private:
-	uint8_t *buffer;
+	// Pages in use, oldest first. The newest one is written at current_pointer.
+	uint8_t **pages;
+	uint32_t max_pages;
+	uint32_t page_start;
+	uint32_t page_count;
+	size_t page_size;
+	uint8_t **free_pages;
+	uint32_t free_page_count;
+	uint32_t allocated_pages;
+	uint32_t peak_pages;
+	// Pages are slots of a memory-mapped file instead of heap allocations when a file is given.
+	uint8_t *mapping;
+	size_t mapping_size;
+	uint8_t **mapped_slots;
+	uint32_t mapped_slot_count;
 	uint8_t **pointers;
 	size_t *sizes;
 	int64_t *timestamps;
 	bool *is_keyframes;
-	size_t buffer_size;
+	// Frame slots, grown as frames arrive.
 	uint32_t count;
+	int64_t duration;
 	uint32_t index;
-	bool is_full;
 	uint32_t index_start;
 	uint8_t *current_pointer;
+	// Number of stored frames, from index_start to index.
+	uint32_t frame_count;
+	// Sequence number of the frame at index_start, frames are numbered in the order they are added.
+	uint32_t first_sequence;
+	// Ring of sequence numbers of the stored keyframes, oldest first.
+	uint32_t *keyframes;
+	uint32_t keyframe_slots;
+	uint32_t keyframe_start;
+	uint32_t keyframe_count;
+	// A frame was lost, the frames that depend on it are dropped.
+	bool is_keyframe_needed;
+	bool map_file(const char *filename, size_t size);
+	void unmap_file();
+	uint8_t *allocate_page();
+	void free_page(uint8_t *page);
+	uint8_t *get_page(uint32_t page);
+	bool is_in_page(uint8_t *data, size_t size, uint8_t *page);
+	bool add_page(bool is_evicting);
+	void release_pages();
+	bool grow();
+	bool grow_keyframes();
+	uint32_t get_keyframe_index(uint32_t keyframe);
+	void evict_gop();
+	void evict_expired_frames(int64_t start_timestamp);
 public:
 	CircularBuffer();
 	~CircularBuffer();
-	bool init(size_t buffer_size, uint32_t count);
+	// Duration is in milliseconds of frame timestamps. Frames larger than a page are not stored. With a filename the
+	// pages are stored in that file of memory_limit bytes, mapped into memory.
+	bool init(size_t memory_limit, size_t page_size, int64_t duration, const char *filename);
 	bool add_frame(uint8_t *data, size_t size, int64_t timestamp, bool is_keyframe);
+	bool needs_keyframe();
+	int64_t get_window_start(int64_t end_timestamp);
+	bool find_keyframe(int64_t timestamp, uint32_t *frame_index);
 	bool get_frame(uint8_t **data, size_t *size, int64_t *timestamp, bool *is_keyframe, uint32_t *frame_index);
+	// Allocated memory now and at most since init, in bytes.
+	size_t get_memory_size();
+	size_t get_peak_memory_size();
 };
 
-#endif
\ No newline at end of file
+#endif
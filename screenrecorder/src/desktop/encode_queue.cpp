@@ -0,0 +1,166 @@
+#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS) || defined(DM_PLATFORM_HTML5)
+
+#include "encode_queue.h"
+
+EncodeQueue::EncodeQueue() :
+	frame_pool(NULL),
+	capacity(0),
+	policy(QUEUE_POLICY_BLOCK),
+	timestamps(NULL),
+	queue(NULL),
+	queue_start(0),
+	queue_count(0),
+	free_slots(NULL),
+	free_count(0),
+	acquired_slot(-1),
+	encoding_slot(-1),
+	is_closed(false),
+	max_depth(0),
+	dropped_frames(0) {
+		thread_mutex_init(&mutex);
+		thread_signal_init(&frame_signal);
+		thread_signal_init(&slot_signal);
+	}
+
+EncodeQueue::~EncodeQueue() {
+	release();
+	thread_signal_term(&slot_signal);
+	thread_signal_term(&frame_signal);
+	thread_mutex_term(&mutex);
+}
+
+void EncodeQueue::release() {
+	delete []timestamps;
+	delete []queue;
+	delete []free_slots;
+	timestamps = NULL;
+	queue = NULL;
+	free_slots = NULL;
+}
+
+bool EncodeQueue::init(FramePool *frame_pool, int capacity, int policy) {
+	release();
+	int slot_count = capacity + 1;
+	if (capacity < 1 || frame_pool->get_count() < slot_count) {
+		return false;
+	}
+	this->frame_pool = frame_pool;
+	this->capacity = capacity;
+	this->policy = policy;
+	timestamps = new int64_t[slot_count];
+	queue = new int[capacity];
+	free_slots = new int[slot_count];
+	if (timestamps == NULL || queue == NULL || free_slots == NULL) {
+		return false;
+	}
+	for (int i = 0; i < slot_count; ++i) {
+		free_slots[i] = i;
+	}
+	free_count = slot_count;
+	queue_start = 0;
+	queue_count = 0;
+	acquired_slot = -1;
+	encoding_slot = -1;
+	is_closed = false;
+	max_depth = 0;
+	dropped_frames = 0;
+	return true;
+}
+
+// Returns a frame buffer to fill, NULL if the frame has to be dropped. Only one frame can be acquired at a time.
+uint8_t *EncodeQueue::acquire() {
+	thread_mutex_lock(&mutex);
+	while (queue_count == capacity || free_count == 0) {
+		if (policy == QUEUE_POLICY_DROP_NEWEST) {
+			++dropped_frames;
+			thread_mutex_unlock(&mutex);
+			return NULL;
+		} else if (policy == QUEUE_POLICY_DROP_OLDEST && queue_count > 0) {
+			free_slots[free_count++] = queue[queue_start];
+			queue_start = (queue_start + 1) % capacity;
+			--queue_count;
+			++dropped_frames;
+		} else {
+			thread_mutex_unlock(&mutex);
+			thread_signal_wait(&slot_signal, THREAD_SIGNAL_WAIT_INFINITE);
+			thread_mutex_lock(&mutex);
+		}
+	}
+	acquired_slot = free_slots[--free_count];
+	thread_mutex_unlock(&mutex);
+	return frame_pool->get_frame(acquired_slot);
+}
+
+// Queue the acquired frame for encoding.
+void EncodeQueue::push(int64_t timestamp) {
+	thread_mutex_lock(&mutex);
+	timestamps[acquired_slot] = timestamp;
+	queue[(queue_start + queue_count) % capacity] = acquired_slot;
+	++queue_count;
+	if ((uint32_t)queue_count > max_depth) {
+		max_depth = queue_count;
+	}
+	acquired_slot = -1;
+	thread_mutex_unlock(&mutex);
+	thread_signal_raise(&frame_signal);
+}
+
+// Waits for the next frame to encode. Returns NULL once the queue is closed and empty.
+uint8_t *EncodeQueue::pop(int64_t *timestamp) {
+	thread_mutex_lock(&mutex);
+	while (queue_count == 0) {
+		if (is_closed) {
+			thread_mutex_unlock(&mutex);
+			return NULL;
+		}
+		thread_mutex_unlock(&mutex);
+		thread_signal_wait(&frame_signal, THREAD_SIGNAL_WAIT_INFINITE);
+		thread_mutex_lock(&mutex);
+	}
+	encoding_slot = queue[queue_start];
+	queue_start = (queue_start + 1) % capacity;
+	--queue_count;
+	*timestamp = timestamps[encoding_slot];
+	thread_mutex_unlock(&mutex);
+	return frame_pool->get_frame(encoding_slot);
+}
+
+// Return the popped frame buffer to the queue.
+void EncodeQueue::finish() {
+	thread_mutex_lock(&mutex);
+	free_slots[free_count++] = encoding_slot;
+	encoding_slot = -1;
+	thread_mutex_unlock(&mutex);
+	thread_signal_raise(&slot_signal);
+}
+
+// Let the encoding thread drain the remaining frames and exit.
+void EncodeQueue::close() {
+	thread_mutex_lock(&mutex);
+	is_closed = true;
+	thread_mutex_unlock(&mutex);
+	thread_signal_raise(&frame_signal);
+}
+
+uint32_t EncodeQueue::get_depth() {
+	thread_mutex_lock(&mutex);
+	uint32_t depth = queue_count;
+	thread_mutex_unlock(&mutex);
+	return depth;
+}
+
+uint32_t EncodeQueue::get_max_depth() {
+	thread_mutex_lock(&mutex);
+	uint32_t depth = max_depth;
+	thread_mutex_unlock(&mutex);
+	return depth;
+}
+
+uint32_t EncodeQueue::get_dropped_frames() {
+	thread_mutex_lock(&mutex);
+	uint32_t count = dropped_frames;
+	thread_mutex_unlock(&mutex);
+	return count;
+}
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef encode_queue_h
+#define encode_queue_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <thread.h>
+#include "frame_pool.h"
+
+// What to do with a new frame when the queue is full.
+enum QueuePolicy {
+	QUEUE_POLICY_BLOCK,
+	QUEUE_POLICY_DROP_NEWEST,
+	QUEUE_POLICY_DROP_OLDEST
+};
+
+// Bounded queue of raw I420 frames between the capturing thread and the encoding thread.
+// Frame buffers come from the pool, one more than the queue capacity is needed for the frame being encoded.
+class EncodeQueue {
+private:
+	FramePool *frame_pool;
+	int capacity;
+	int policy;
+	int64_t *timestamps;
+	int *queue;
+	int queue_start;
+	int queue_count;
+	int *free_slots;
+	int free_count;
+	int acquired_slot;
+	int encoding_slot;
+	bool is_closed;
+	uint32_t max_depth;
+	uint32_t dropped_frames;
+	thread_mutex_t mutex;
+	thread_signal_t frame_signal;
+	thread_signal_t slot_signal;
+	void release();
+public:
+	EncodeQueue();
+	~EncodeQueue();
+	bool init(FramePool *frame_pool, int capacity, int policy);
+	uint8_t *acquire();
+	void push(int64_t timestamp);
+	uint8_t *pop(int64_t *timestamp);
+	void finish();
+	void close();
+	uint32_t get_depth();
+	uint32_t get_max_depth();
+	uint32_t get_dropped_frames();
+};
+
+#endif
@@ -0,0 +1,107 @@
+#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS) || defined(DM_PLATFORM_HTML5)
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define FRAME_POOL_SSE2
+	#include <emmintrin.h>
+#endif
+
+#include "frame_pool.h"
+
+static const size_t ALIGNMENT = 64;
+
+FramePool::FramePool() :
+	memory(NULL),
+	frames(NULL),
+	frame_size(0),
+	frame_stride(0),
+	count(0) {
+	}
+
+FramePool::~FramePool() {
+	release();
+}
+
+void FramePool::release() {
+	delete []memory;
+	memory = NULL;
+	frames = NULL;
+	frame_size = 0;
+	frame_stride = 0;
+	count = 0;
+}
+
+bool FramePool::init(size_t frame_size, int count) {
+	if (frames != NULL && frame_size == this->frame_size && count == this->count) {
+		return true;
+	}
+	release();
+	if (count < 1) {
+		return false;
+	}
+	frame_stride = (frame_size + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+	memory = new uint8_t[frame_stride * count + ALIGNMENT];
+	if (memory == NULL) {
+		return false;
+	}
+	frames = memory + (ALIGNMENT - (uintptr_t)memory % ALIGNMENT) % ALIGNMENT;
+	this->frame_size = frame_size;
+	this->count = count;
+	return true;
+}
+
+uint8_t *FramePool::get_frame(int index) {
+	return frames + index * frame_stride;
+}
+
+int FramePool::get_count() {
+	return count;
+}
+
+// Copy with non-temporal stores, the frame is not read again by this thread and should not evict the cache.
+// Destination is expected to be a pool frame.
+void FramePool::stream_copy(uint8_t *destination, const uint8_t *source, size_t size) {
+	#ifdef FRAME_POOL_SSE2
+		if ((uintptr_t)destination % 16 == 0) {
+			size_t block_size = size & ~(size_t)63;
+			for (size_t i = 0; i < block_size; i += 64) {
+				__m128i a = _mm_loadu_si128((const __m128i *)(source + i));
+				__m128i b = _mm_loadu_si128((const __m128i *)(source + i + 16));
+				__m128i c = _mm_loadu_si128((const __m128i *)(source + i + 32));
+				__m128i d = _mm_loadu_si128((const __m128i *)(source + i + 48));
+				_mm_stream_si128((__m128i *)(destination + i), a);
+				_mm_stream_si128((__m128i *)(destination + i + 16), b);
+				_mm_stream_si128((__m128i *)(destination + i + 32), c);
+				_mm_stream_si128((__m128i *)(destination + i + 48), d);
+			}
+			_mm_sfence();
+			memcpy(destination + block_size, source + block_size, size - block_size);
+			return;
+		}
+	#endif
+	memcpy(destination, source, size);
+}
+
+// Non-cryptographic hash of a whole frame, used to find frames identical to the previous one. Four independent lanes
+// keep the multiplier busy, so hashing runs close to memory speed.
+uint64_t FramePool::hash(const uint8_t *data, size_t size) {
+	const uint64_t prime = 0x9E3779B97F4A7C15ull;
+	uint64_t lanes[4] = {size, prime, ~(uint64_t)size, ~prime};
+	size_t block_size = size & ~(size_t)31;
+	for (size_t i = 0; i < block_size; i += 32) {
+		for (int j = 0; j < 4; ++j) {
+			uint64_t word;
+			memcpy(&word, data + i + 8 * j, 8);
+			lanes[j] = (lanes[j] ^ word) * prime;
+			lanes[j] ^= lanes[j] >> 29;
+		}
+	}
+	uint64_t result = lanes[0] ^ (lanes[1] * 3) ^ (lanes[2] * 5) ^ (lanes[3] * 7);
+	for (size_t i = block_size; i < size; ++i) {
+		result = (result ^ data[i]) * prime;
+	}
+	return result ^ (result >> 32);
+}
+
+#endif
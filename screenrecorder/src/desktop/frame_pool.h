@@ -0,0 +1,26 @@
+#ifndef frame_pool_h
+#define frame_pool_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Preallocated raw video frames. Frames are aligned to cache lines and reused between recordings of the same size.
+class FramePool {
+private:
+	uint8_t *memory;
+	uint8_t *frames;
+	size_t frame_size;
+	size_t frame_stride;
+	int count;
+	void release();
+public:
+	FramePool();
+	~FramePool();
+	bool init(size_t frame_size, int count);
+	uint8_t *get_frame(int index);
+	int get_count();
+	static void stream_copy(uint8_t *destination, const uint8_t *source, size_t size);
+	static uint64_t hash(const uint8_t *data, size_t size);
+};
+
+#endif
@@ -1,6 +1,8 @@
 #if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS) || defined(DM_PLATFORM_HTML5)
 
 #include <string>
+#include <string.h>
+#include <thread>
 
 #include "screenrecorder.h"
 #include "utils.h"
@@ -29,7 +31,6 @@
 	static PFNGLBINDBUFFERPROC glBindBuffer = NULL;
 	static PFNGLBUFFERDATAPROC glBufferData = NULL;
 	static PFNGLGETUNIFORMLOCATIONPROC glGetUniformLocation = NULL;
-	static PFNGLGETATTRIBLOCATIONPROC glGetAttribLocation = NULL;
 	static PFNGLVERTEXATTRIBPOINTERPROC glVertexAttribPointer = NULL;
 	static PFNGLISFRAMEBUFFERPROC glIsFramebuffer = NULL;
 	static PFNGLDELETEFRAMEBUFFERSPROC glDeleteFramebuffers = NULL;
@@ -43,9 +44,19 @@
 	static PFNGLENABLEVERTEXATTRIBARRAYPROC glEnableVertexAttribArray = NULL;
 	static PFNGLUNIFORM2FPROC glUniform2f = NULL;
 	static PFNGLDISABLEVERTEXATTRIBARRAYPROC glDisableVertexAttribArray = NULL;
-	static PFNGLGETBUFFERPARAMETERIVPROC glGetBufferParameteriv = NULL;
 	static PFNGLUNMAPBUFFERPROC glUnmapBuffer = NULL;
 	static PFNGLMAPBUFFERPROC glMapBuffer = NULL;
+	static PFNGLFENCESYNCPROC glFenceSync = NULL;
+	static PFNGLCLIENTWAITSYNCPROC glClientWaitSync = NULL;
+	static PFNGLDELETESYNCPROC glDeleteSync = NULL;
+	static PFNGLGETSTRINGIPROC glGetStringi = NULL;
+	static PFNGLMAPBUFFERRANGEPROC glMapBufferRange = NULL;
+	static PFNGLBUFFERSTORAGEPROC glBufferStorage = NULL;
+	static PFNGLBINDATTRIBLOCATIONPROC glBindAttribLocation = NULL;
+	static PFNGLGENVERTEXARRAYSPROC glGenVertexArrays = NULL;
+	static PFNGLBINDVERTEXARRAYPROC glBindVertexArray = NULL;
+	static PFNGLDELETEVERTEXARRAYSPROC glDeleteVertexArrays = NULL;
+	static PFNGLDEBUGMESSAGECALLBACKPROC glDebugMessageCallback = NULL;
 #endif
 
 // Adapt to OpenGL ES for HTML5 platform.
@@ -136,6 +147,123 @@ static const char *fragment_shader_source = SHADER_HEADER
 		"}"
 	"}";
 
+// Variant of fragment_shader_source that writes the I420 frame into a width / 4 by height * 3 / 2 RGBA texture, four
+// consecutive plane bytes per texel. Rows are read back in memory order. Requires width divisible by 8.
+static const char *packed_fragment_shader_source = SHADER_HEADER
+	"#ifdef GL_FRAGMENT_PRECISION_HIGH\n"
+	"precision highp float;\n"
+	"#endif\n"
+	"uniform sampler2D tex0;"
+	"uniform vec2 scale;"
+	"uniform vec2 resolution;"
+
+	// Pixel (x, y) of the scaled frame, top-down. Return black color if source pixel is outside of the image area.
+	"vec4 get_pixel(float x, float y) {"
+		"vec2 source = ((vec2(x, y) + 0.5) / resolution - 0.5) / scale + 0.5;"
+		"if (source.x >= 0.0 && source.y >= 0.0 && source.x <= 1.0 && source.y <= 1.0) return texture2D(tex0, vec2(source.x, 1.0 - source.y));"
+		"return vec4(0.0, 0.0, 0.0, 1.0);"
+	"}"
+
+	"float get_y(vec4 rgba) {return 0.299 * rgba.r + 0.587 * rgba.g + 0.114 * rgba.b;}"
+	"float get_u(vec4 rgba) {return -0.169 * rgba.r - 0.331 * rgba.g + 0.5 * rgba.b + 0.5;}"
+	"float get_v(vec4 rgba) {return 0.5 * rgba.r - 0.419 * rgba.g - 0.081 * rgba.b + 0.5;}"
+
+	"void main() {"
+		"float width = resolution.x;"
+		"float height = resolution.y;"
+		"float x = 4.0 * floor(gl_FragCoord.x);"
+		"float row = floor(gl_FragCoord.y);"
+		"if (row < height) {"
+			// Y plane, one frame row per texture row.
+			"gl_FragColor = vec4(get_y(get_pixel(x, row)), get_y(get_pixel(x + 1.0, row)), get_y(get_pixel(x + 2.0, row)), get_y(get_pixel(x + 3.0, row)));"
+		"} else {"
+			// U and V planes, two half width rows per texture row. Chroma is sampled from even pixels of even rows.
+			"float offset = (row - height) * width + x;"
+			"float plane_size = width * height / 4.0;"
+			"bool is_v = offset >= plane_size;"
+			"if (is_v) offset -= plane_size;"
+			"float chroma_row = floor((offset + 0.5) / (width / 2.0));"
+			"x = 2.0 * (offset - chroma_row * width / 2.0);"
+			"float y = 2.0 * chroma_row;"
+			"vec4 p0 = get_pixel(x, y);"
+			"vec4 p1 = get_pixel(x + 2.0, y);"
+			"vec4 p2 = get_pixel(x + 4.0, y);"
+			"vec4 p3 = get_pixel(x + 6.0, y);"
+			"if (is_v) {"
+				"gl_FragColor = vec4(get_v(p0), get_v(p1), get_v(p2), get_v(p3));"
+			"} else {"
+				"gl_FragColor = vec4(get_u(p0), get_u(p1), get_u(p2), get_u(p3));"
+			"}"
+		"}"
+	"}";
+
+#ifndef DM_PLATFORM_HTML5
+	// Common part of the planar conversion shaders, they render straight into R8 plane textures without branching.
+	#define PLANAR_SHADER_FUNCTIONS \
+		"uniform sampler2D tex0;"\
+		"uniform vec2 scale;"\
+		"uniform vec2 resolution;"\
+		/* Position is in pixels of the scaled frame, top-down. Return black color if source pixel is outside of the image area. */\
+		"vec4 get_pixel(vec2 position) {"\
+			"vec2 source = (position / resolution - 0.5) / scale + 0.5;"\
+			"if (source.x >= 0.0 && source.y >= 0.0 && source.x <= 1.0 && source.y <= 1.0) return texture2D(tex0, vec2(source.x, 1.0 - source.y));"\
+			"return vec4(0.0, 0.0, 0.0, 1.0);"\
+		"}"
+
+	// Y plane, full resolution.
+	static const char *luma_fragment_shader_source = SHADER_HEADER
+		PLANAR_SHADER_FUNCTIONS
+		"void main() {"
+			"vec4 rgba = get_pixel(gl_FragCoord.xy);"
+			"gl_FragColor = vec4(0.299 * rgba.r + 0.587 * rgba.g + 0.114 * rgba.b);"
+		"}";
+
+	// U and V planes, half resolution, written to two color attachments at once. Each chroma pixel samples the corner
+	// shared by its 2x2 block, so bilinear filtering of the source texture averages the block.
+	static const char *chroma_fragment_shader_source = SHADER_HEADER
+		PLANAR_SHADER_FUNCTIONS
+		"void main() {"
+			"vec4 rgba = get_pixel(2.0 * gl_FragCoord.xy);"
+			"gl_FragData[0] = vec4(-0.169 * rgba.r - 0.331 * rgba.g + 0.5 * rgba.b + 0.5);"
+			"gl_FragData[1] = vec4(0.5 * rgba.r - 0.419 * rgba.g - 0.081 * rgba.b + 0.5);"
+		"}";
+
+	// Macroblock change mask for the encoder's active map, one texel per 16x16 block. Compares the Y plane in tex0 and
+	// the U and V planes in tex2 and tex3 with the previous frame's planes in tex1, the Y plane with the U and V planes
+	// side by side below it. Chroma is compared too, a hue change can keep luma the same. Blocks on the right and bottom
+	// edges are clamped to the planes.
+	static const char *active_map_fragment_shader_source = SHADER_HEADER
+		"uniform sampler2D tex0;"
+		"uniform sampler2D tex1;"
+		"uniform sampler2D tex2;"
+		"uniform sampler2D tex3;"
+		"uniform vec2 resolution;"
+		"void main() {"
+			"vec2 previous_size = vec2(resolution.x, resolution.y * 1.5);"
+			"vec2 chroma_size = floor(resolution / 2.0);"
+			"vec2 origin = 16.0 * floor(gl_FragCoord.xy) + 0.5;"
+			"vec2 chroma_origin = 8.0 * floor(gl_FragCoord.xy) + 0.5;"
+			"float difference = 0.0;"
+			"for (int y = 0; y < 16; ++y) {"
+				"for (int x = 0; x < 16; ++x) {"
+					"vec2 position = min(origin + vec2(float(x), float(y)), resolution - 0.5);"
+					"difference = max(difference, abs(texture2D(tex0, position / resolution).r - texture2D(tex1, position / previous_size).r));"
+				"}"
+			"}"
+			"for (int y = 0; y < 8; ++y) {"
+				"for (int x = 0; x < 8; ++x) {"
+					"vec2 position = min(chroma_origin + vec2(float(x), float(y)), chroma_size - 0.5);"
+					"vec2 previous_u = (position + vec2(0.0, resolution.y)) / previous_size;"
+					"vec2 previous_v = (position + vec2(chroma_size.x, resolution.y)) / previous_size;"
+					"difference = max(difference, abs(texture2D(tex2, position / chroma_size).r - texture2D(tex1, previous_u).r));"
+					"difference = max(difference, abs(texture2D(tex3, position / chroma_size).r - texture2D(tex1, previous_v).r));"
+				"}"
+			"}"
+			// Reads back as 1 for a changed block, as the encoder expects.
+			"gl_FragColor = vec4(step(0.5 / 255.0, difference) / 255.0);"
+		"}";
+#endif
+
 // Quad model.
 static float quad_model[] = {
 	// position		// texture coords
@@ -147,30 +275,136 @@ static float quad_model[] = {
 	 1.0f,  1.0f,	1.0f, 1.0f, // right top
 };
 
-// Use Pixel Buffer Objects for better performance. Not available on HTML5.
-static const int PBO_COUNT = 3;
+// Attribute locations are bound before linking, so every YUV program shares the quad model's vertex array.
+static const GLuint POSITION_ATTRIB = 0;
+static const GLuint TEXCOORD_ATTRIB = 1;
+
+// Active map trailer after the mask of each frame: sequence number of the mask and whether it is valid.
+static const int ACTIVE_MAP_TRAILER_SIZE = sizeof(uint32_t) + 1;
+
+// Fastest VP8 realtime speed the governor goes to, the slowest one comes from the encoder settings.
+static const int MAX_ENCODER_SPEED = 16;
+// Frames encoded after a speed change before the next one, so the average reflects the new speed.
+static const int SPEED_ADJUSTMENT_FRAMES = 15;
+// Temporal layers: base layer frames only reference and update the last frame, enhancement layer frames reference
+// the last frame and update nothing, so any of them can be dropped.
+static const int TEMPORAL_LAYERS = 2;
+static const vpx_enc_frame_flags_t BASE_LAYER_FLAGS = VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF | VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF;
+static const vpx_enc_frame_flags_t ENHANCEMENT_LAYER_FLAGS = VP8_EFLAG_NO_REF_GF | VP8_EFLAG_NO_REF_ARF | VP8_EFLAG_NO_UPD_LAST | VP8_EFLAG_NO_UPD_GF | VP8_EFLAG_NO_UPD_ARF | VP8_EFLAG_NO_UPD_ENTROPY;
+
+// Internal resolutions of the encoder for each VPX_SCALING mode, as a fraction of the frame size. The encoder is
+// scaled down when the fastest speed is not enough.
+static const int SCALE_RATIOS[][2] = {{1, 1}, {4, 5}, {3, 5}, {1, 2}};
+static const int MAX_ENCODER_SCALE = VP8E_ONETWO;
+// Frames encoded after a speed or scale change before the next scale change, every scale change costs a keyframe.
+static const int SCALE_ADJUSTMENT_FRAMES = 60;
+
+// Smallest replay buffer page and the granularity of page sizes, in bytes.
+static const size_t MIN_REPLAY_PAGE_SIZE = 256 * 1024;
+static const size_t REPLAY_PAGE_ALIGNMENT = 64 * 1024;
+
+// Number of frames captured with each color conversion backend before the faster one is chosen.
+static const int CALIBRATION_FRAMES = 60;
+
+// Error check after a GL call on the capture path. Only verbose validation checks every call.
+#define CHECK_GL_ERROR(stage) if (gl_validation == GL_VALIDATION_VERBOSE) {GLenum error = glGetError(); if (error) {ERROR_MESSAGE(stage ": %#04X", error); return false;}}
 
 static void clear_gl_errors() {
 	while (glGetError() != GL_NO_ERROR) {}
 }
 
+#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+	// Look up an OpenGL extension in both compatibility and core profiles.
+	static bool has_gl_extension(const char *name) {
+		const char *extensions = (const char *)glGetString(GL_EXTENSIONS);
+		if (extensions != NULL) {
+			size_t length = strlen(name);
+			for (const char *found = strstr(extensions, name); found != NULL; found = strstr(found + length, name)) {
+				if ((found == extensions || found[-1] == ' ') && (found[length] == ' ' || found[length] == '\0')) {
+					return true;
+				}
+			}
+			return false;
+		}
+		clear_gl_errors();
+		if (glGetStringi == NULL) {
+			return false;
+		}
+		GLint count = 0;
+		glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+		for (GLint i = 0; i < count; ++i) {
+			const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+			if (extension != NULL && strcmp(extension, name) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// Reports errors of every GL call as they happen in verbose validation mode, including the ones made by Defold.
+	static void APIENTRY gl_debug_callback(GLenum /*source*/, GLenum type, GLuint /*id*/, GLenum /*severity*/, GLsizei /*length*/, const GLchar *message, const void * /*user_param*/) {
+		if (type == GL_DEBUG_TYPE_ERROR) {
+			dmLogError("GL debug: %s", message);
+		}
+	}
+#endif
+
 static int encoding_thread_proc(void *user_data) {
 	thread_set_high_priority();
 	ScreenRecorder *sr = static_cast<ScreenRecorder *>(user_data);
-	while (true) {
-		thread_signal_wait(&sr->encoding_signal, THREAD_SIGNAL_WAIT_INFINITE);
-		if (!sr->should_encoding_thread_exit) {
-			sr->is_enconding_thread_available = false;
-			sr->encode_frame(false);
-			thread_signal_raise(&sr->encoding_done_signal);
-			sr->is_enconding_thread_available = true;
-		} else {
-			break;
-		}
+	while (sr->encode_queued_frame()) {
 	}
 	return 0;
 }
 
+void get_encoder_preset(int preset, EncoderSettings *settings) {
+	#ifdef DM_PLATFORM_HTML5
+		int cores = 1;
+	#else
+		int cores = std::thread::hardware_concurrency();
+		if (cores < 1) {
+			cores = 1;
+		}
+	#endif
+	settings->threads = cores;
+	settings->token_partitions = 1;
+	while (settings->token_partitions < 8 && settings->token_partitions * 2 <= cores) {
+		settings->token_partitions *= 2;
+	}
+	settings->rate_control = RATE_CONTROL_VBR;
+	settings->buffer_initial_size = 4000;
+	settings->buffer_optimal_size = 5000;
+	settings->buffer_size = 6000;
+	switch (preset) {
+		case ENCODER_PRESET_REALTIME_LOW_CPU:
+			// Coarser frames at a higher speed encode faster.
+			settings->min_quantizer = 4;
+			settings->max_quantizer = 56;
+			settings->drop_frame_threshold = 30;
+			settings->encoder_speed = 12;
+			settings->min_encoder_speed = 8;
+			break;
+		case ENCODER_PRESET_ARCHIVAL_QUALITY:
+			// Rate control never drops frames and the buffer absorbs longer bitrate peaks.
+			settings->min_quantizer = 0;
+			settings->max_quantizer = 40;
+			settings->buffer_initial_size = 6000;
+			settings->buffer_optimal_size = 8000;
+			settings->buffer_size = 10000;
+			settings->drop_frame_threshold = 0;
+			settings->encoder_speed = 4;
+			settings->min_encoder_speed = 1;
+			break;
+		default:
+			settings->min_quantizer = 2;
+			settings->max_quantizer = 50;
+			settings->drop_frame_threshold = 25;
+			settings->encoder_speed = 8;
+			settings->min_encoder_speed = 4;
+			break;
+	}
+}
+
 ScreenRecorder::ScreenRecorder() :
 	// Use pixels buffer instead of PBO on HTML5.
 	#ifdef DM_PLATFORM_HTML5
@@ -178,22 +412,91 @@ ScreenRecorder::ScreenRecorder() :
 	#endif
 	scaled_texture(0),
 	shader_program(0),
+	packed_shader_program(0),
+	luma_shader_program(0),
+	chroma_shader_program(0),
+	yuv_program(),
+	chroma_program(),
 	vertex_buffer(0),
-	position_attrib(0),
-	texcoord_attrib(0),
-	tex_uniform(0),
-	scale_uniform(0),
-	resolution_uniform(0),
+	vertex_array(0),
 	fbo(0),
-	pbo_index(0),
-	is_pbo_full(false),
+	chroma_fbo(0),
+	u_texture(0),
+	v_texture(0),
+	active_map_shader_program(0),
+	active_map_program(),
+	active_map_fbo(0),
+	active_map_texture(0),
+	previous_planes_texture(0),
+	is_active_map(false),
+	is_previous_planes_valid(false),
+	active_map_cols(0),
+	active_map_rows(0),
+	active_map_id(0),
+	encoded_active_map_id(0),
+	is_last_frame_reference(false),
+	source_fbo(0),
+	source_texture_width(0),
+	source_texture_height(0),
+	pbo(NULL),
+	pbo_conversion(NULL),
+	pbo_timestamps(NULL),
+	pbo_active_map_ids(NULL),
+	pbo_active_map_valid(NULL),
+	#ifndef DM_PLATFORM_HTML5
+		pbo_fences(NULL),
+		pbo_pointers(NULL),
+		is_fence_available(false),
+		is_persistent_mapping(false),
+	#endif
+	pbo_count(0),
+	pbo_head(0),
+	pbo_pending(0),
+	conversion(CONVERSION_GPU),
+	gpu_format(GPU_FORMAT_RGB),
+	calibration_frame(0),
+	gl_validation(GL_VALIDATION_VERBOSE),
+	is_gl_recheck(false),
+	is_debug_output(false),
 	frame_count(0),
+	first_frame_time(0),
+	last_timestamp(-1),
+	frame_interval(0),
+	next_frame_time(0),
+	frame_hash(0),
+	has_frame_hash(false),
+	static_end_timestamp(-1),
+	layer_frame_count(0),
+	region_count(0),
+	roi_map(NULL),
+	average_encode_time(0),
+	adjustment_frames(0),
+	scaled_active_map(NULL),
+	resolution_change_count(0),
 	circular_buffer(NULL),
 	encoding_thread(NULL),
 	is_initialized(false),
-	should_encoding_thread_exit(false),
-	is_enconding_thread_available(true),
+	prepared_key(),
+	is_prepared(false),
+	is_encoder_ready(false),
+	pts_offset(0),
+	next_pts_offset(0),
+	is_keyframe_forced(false),
+	stats(),
 	capture_params() {
+		thread_atomic_int_store(&static_frames, 0);
+		thread_atomic_int_store(&layer_dropped_frames, 0);
+		thread_atomic_int_store(&replay_memory, 0);
+		thread_atomic_int_store(&replay_peak_memory, 0);
+		thread_mutex_init(&regions_mutex);
+		thread_atomic_int_store(&is_roi_map_changed, 0);
+		thread_atomic_int_store(&encoder_speed, 0);
+		thread_atomic_int_store(&encode_time, 0);
+		for (int i = 0; i < ENCODE_TIME_BUCKETS; ++i) {
+			thread_atomic_int_store(&encode_time_histogram[i], 0);
+		}
+		thread_atomic_int_store(&encoder_scale, VP8E_NORMAL);
+		thread_mutex_init(&resolution_changes_mutex);
 		// Load OpenGL functions.
 		#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
 			#if defined(DM_PLATFORM_WINDOWS)
@@ -218,7 +521,6 @@ ScreenRecorder::ScreenRecorder() :
 			GET_PROC_ADDRESS(glBindBuffer, "glBindBuffer", PFNGLBINDBUFFERPROC)
 			GET_PROC_ADDRESS(glBufferData, "glBufferData", PFNGLBUFFERDATAPROC)
 			GET_PROC_ADDRESS(glGetUniformLocation, "glGetUniformLocation", PFNGLGETUNIFORMLOCATIONPROC)
-			GET_PROC_ADDRESS(glGetAttribLocation, "glGetAttribLocation", PFNGLGETATTRIBLOCATIONPROC)
 			GET_PROC_ADDRESS(glVertexAttribPointer, "glVertexAttribPointer", PFNGLVERTEXATTRIBPOINTERPROC)
 			GET_PROC_ADDRESS(glIsFramebuffer, "glIsFramebuffer", PFNGLISFRAMEBUFFERPROC)
 			GET_PROC_ADDRESS(glDeleteFramebuffers, "glDeleteFramebuffers", PFNGLDELETEFRAMEBUFFERSPROC)
@@ -232,40 +534,104 @@ ScreenRecorder::ScreenRecorder() :
 			GET_PROC_ADDRESS(glEnableVertexAttribArray, "glEnableVertexAttribArray", PFNGLENABLEVERTEXATTRIBARRAYPROC)
 			GET_PROC_ADDRESS(glUniform2f, "glUniform2f", PFNGLUNIFORM2FPROC)
 			GET_PROC_ADDRESS(glDisableVertexAttribArray, "glDisableVertexAttribArray", PFNGLDISABLEVERTEXATTRIBARRAYPROC)
-			GET_PROC_ADDRESS(glGetBufferParameteriv, "glGetBufferParameteriv", PFNGLGETBUFFERPARAMETERIVPROC)
 			GET_PROC_ADDRESS(glUnmapBuffer, "glUnmapBuffer", PFNGLUNMAPBUFFERPROC)
 			GET_PROC_ADDRESS(glMapBuffer, "glMapBuffer", PFNGLMAPBUFFERPROC)
+			GET_PROC_ADDRESS(glFenceSync, "glFenceSync", PFNGLFENCESYNCPROC)
+			GET_PROC_ADDRESS(glClientWaitSync, "glClientWaitSync", PFNGLCLIENTWAITSYNCPROC)
+			GET_PROC_ADDRESS(glDeleteSync, "glDeleteSync", PFNGLDELETESYNCPROC)
+			GET_PROC_ADDRESS(glGetStringi, "glGetStringi", PFNGLGETSTRINGIPROC)
+			GET_PROC_ADDRESS(glMapBufferRange, "glMapBufferRange", PFNGLMAPBUFFERRANGEPROC)
+			GET_PROC_ADDRESS(glBufferStorage, "glBufferStorage", PFNGLBUFFERSTORAGEPROC)
+			GET_PROC_ADDRESS(glBindAttribLocation, "glBindAttribLocation", PFNGLBINDATTRIBLOCATIONPROC)
+			GET_PROC_ADDRESS(glGenVertexArrays, "glGenVertexArrays", PFNGLGENVERTEXARRAYSPROC)
+			GET_PROC_ADDRESS(glBindVertexArray, "glBindVertexArray", PFNGLBINDVERTEXARRAYPROC)
+			GET_PROC_ADDRESS(glDeleteVertexArrays, "glDeleteVertexArrays", PFNGLDELETEVERTEXARRAYSPROC)
+			GET_PROC_ADDRESS(glDebugMessageCallback, "glDebugMessageCallback", PFNGLDEBUGMESSAGECALLBACKPROC)
 		#endif
 	}
 
 ScreenRecorder::~ScreenRecorder() {
 	is_initialized = false;
-	if (glIsProgram(shader_program)) {
+	// GL objects exist if any recording captured a render target, later headless recordings keep them.
+	if (shader_program != 0) {
 		glDeleteProgram(shader_program);
 		shader_program = 0;
 		GLenum error = glGetError(); if (error) dmLogError("glDeleteProgram: %#04X", error);
 	}
-	if (glIsBuffer(vertex_buffer)) {
+	if (packed_shader_program != 0) {
+		glDeleteProgram(packed_shader_program);
+		packed_shader_program = 0;
+		GLenum error = glGetError(); if (error) dmLogError("glDeleteProgram packed: %#04X", error);
+	}
+	if (luma_shader_program != 0) {
+		glDeleteProgram(luma_shader_program);
+		glDeleteProgram(chroma_shader_program);
+		luma_shader_program = 0;
+		chroma_shader_program = 0;
+		GLenum error = glGetError(); if (error) dmLogError("glDeleteProgram planar: %#04X", error);
+	}
+	if (active_map_shader_program != 0) {
+		glDeleteProgram(active_map_shader_program);
+		active_map_shader_program = 0;
+		GLenum error = glGetError(); if (error) dmLogError("glDeleteProgram active map: %#04X", error);
+	}
+	#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+		if (vertex_array != 0) {
+			glDeleteVertexArrays(1, &vertex_array);
+			vertex_array = 0;
+			GLenum error = glGetError(); if (error) dmLogError("glDeleteVertexArrays: %#04X", error);
+		}
+	#endif
+	if (vertex_buffer != 0) {
 		glDeleteBuffers(1, &vertex_buffer);
 		vertex_buffer = 0;
 		GLenum error = glGetError(); if (error) dmLogError("glDeleteBuffers: %#04X", error);
 	}
+	delete []pbo;
+	delete []pbo_conversion;
+	delete []pbo_timestamps;
+	delete []pbo_active_map_ids;
+	delete []pbo_active_map_valid;
+	#ifndef DM_PLATFORM_HTML5
+		delete []pbo_fences;
+		delete []pbo_pointers;
+	#endif
 	if (encoding_thread != NULL) {
 		// Finish encoding thread.
-		should_encoding_thread_exit = true;
-		thread_signal_raise(&encoding_signal);
+		encode_queue.close();
 		thread_join(encoding_thread);
 		thread_destroy(encoding_thread);
-		thread_signal_term(&encoding_signal);
 	}
+	#ifdef DM_PLATFORM_HTML5
+		delete []pixels;
+	#endif
+	if (is_encoder_ready) {
+		vpx_codec_destroy(&codec);
+	}
+	delete []roi_map;
+	delete []scaled_active_map;
+	thread_mutex_term(&regions_mutex);
+	thread_mutex_term(&resolution_changes_mutex);
 }
 
 bool ScreenRecorder::init(char *error_message) {
-	if (is_initialized) {
-		return true;
+	// Headless recording receives frames from CPU memory and has no OpenGL context. GL objects are created by the
+	// first recording that captures a render target and kept for the following ones.
+	bool is_gl_missing = !is_initialized || shader_program == 0;
+	if (!capture_params.is_headless && is_gl_missing && !init_gl(error_message)) {
+		return false;
 	}
-	clear_gl_errors();
+
+	is_initialized = true;
+
+	return true;
+}
+
+// Compile and link the shaders of create_program(). Created objects are returned even on failure, so they can be
+// deleted.
+static bool link_program(const char *fragment_shader_source, GLuint *vertex_shader_out, GLuint *fragment_shader_out, GLuint *program, char *error_message) {
 	GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
+	*vertex_shader_out = vertex_shader;
 	GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glCreateShader: %#04X", error); return false;}
 	glShaderSource(vertex_shader, 1, &vertex_shader_source, NULL);
 	error = glGetError(); if (error) {ERROR_MESSAGE("glShaderSource: %#04X", error); return false;}
@@ -281,6 +647,7 @@ bool ScreenRecorder::init(char *error_message) {
 	}
 
 	GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
+	*fragment_shader_out = fragment_shader;
 	glShaderSource(fragment_shader, 1, &fragment_shader_source, NULL);
 	glCompileShader(fragment_shader);
 
@@ -292,123 +659,239 @@ bool ScreenRecorder::init(char *error_message) {
 		return false;
 	}
 
-	shader_program = glCreateProgram();
+	*program = glCreateProgram();
 	error = glGetError(); if (error) {ERROR_MESSAGE("glCreateProgram: %#04X", error); return false;}
-	glAttachShader(shader_program, vertex_shader);
+	glAttachShader(*program, vertex_shader);
 	error = glGetError(); if (error) {ERROR_MESSAGE("glAttachShader v: %#04X", error); return false;}
-	glAttachShader(shader_program, fragment_shader);
+	glAttachShader(*program, fragment_shader);
 	error = glGetError(); if (error) {ERROR_MESSAGE("glAttachShader f: %#04X", error); return false;}
-	glLinkProgram(shader_program);
+	glBindAttribLocation(*program, POSITION_ATTRIB, "position");
+	glBindAttribLocation(*program, TEXCOORD_ATTRIB, "texcoord");
+	error = glGetError(); if (error) {ERROR_MESSAGE("glBindAttribLocation: %#04X", error); return false;}
+	glLinkProgram(*program);
 	error = glGetError(); if (error) {ERROR_MESSAGE("glLinkProgram: %#04X", error); return false;}
-	glGetProgramiv(shader_program, GL_LINK_STATUS, &status);
+	glGetProgramiv(*program, GL_LINK_STATUS, &status);
 	if (!status) {
 		char buffer[512];
-		glGetProgramInfoLog(shader_program, 512, NULL, buffer);
+		glGetProgramInfoLog(*program, 512, NULL, buffer);
 		ERROR_MESSAGE("Failed to link shader:\n%s", buffer);
 		return false;
 	}
+	return true;
+}
 
+// Compile the quad model shader program with the given YUV fragment shader. Optional programs are allowed to fail,
+// the shaders and the program are deleted then, *program is 0.
+static bool create_program(const char *fragment_shader_source, GLuint *program, char *error_message) {
+	GLuint vertex_shader = 0;
+	GLuint fragment_shader = 0;
+	*program = 0;
+	bool is_linked = link_program(fragment_shader_source, &vertex_shader, &fragment_shader, program, error_message);
+	// Shaders attached to a linked program are freed with it.
 	glDeleteShader(vertex_shader);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glDeleteShader v: %#04X", error); return false;}
 	glDeleteShader(fragment_shader);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glDeleteShader f: %#04X", error); return false;}
+	GLenum error = glGetError();
+	if (is_linked && error) {
+		ERROR_MESSAGE("glDeleteShader: %#04X", error);
+		is_linked = false;
+	}
+	if (!is_linked) {
+		glDeleteProgram(*program);
+		*program = 0;
+	}
+	return is_linked;
+}
+
+bool ScreenRecorder::init_gl(char *error_message) {
+	clear_gl_errors();
+	if (!create_program(fragment_shader_source, &shader_program, error_message)) {
+		return false;
+	}
+	// The packed variant is optional, GPU conversion falls back to the RGB shader without it.
+	if (!create_program(packed_fragment_shader_source, &packed_shader_program, error_message)) {
+		dmLogInfo("RGBA packed YUV shader is not available: %s", error_message);
+		clear_gl_errors();
+	}
+	#ifndef DM_PLATFORM_HTML5
+		// Planar conversion needs multiple render targets, it is preferred when available.
+		if (!create_program(luma_fragment_shader_source, &luma_shader_program, error_message)
+			|| !create_program(chroma_fragment_shader_source, &chroma_shader_program, error_message)) {
+			dmLogInfo("Planar YUV shaders are not available: %s", error_message);
+			// The luma program may have linked before the chroma one failed.
+			glDeleteProgram(luma_shader_program);
+			luma_shader_program = 0;
+			clear_gl_errors();
+		}
+		// Without the active map every macroblock is encoded.
+		if (luma_shader_program != 0 && !create_program(active_map_fragment_shader_source, &active_map_shader_program, error_message)) {
+			dmLogInfo("Active map shader is not available: %s", error_message);
+			clear_gl_errors();
+		}
+	#endif
 
 	glGenBuffers(1, &vertex_buffer);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glGenBuffers: %#04X", error); return false;}
+	GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glGenBuffers: %#04X", error); return false;}
 	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
 	error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer: %#04X", error); return false;}
 	glBufferData(GL_ARRAY_BUFFER, sizeof(quad_model), quad_model, GL_STATIC_DRAW);
 	error = glGetError(); if (error) {ERROR_MESSAGE("glBufferData: %#04X", error); return false;}
 
-	tex_uniform = glGetUniformLocation(shader_program, "tex0");
-	error = glGetError(); if (error) {ERROR_MESSAGE("glGetUniformLocation position: %#04X", error); return false;}
+	// Record the vertex attributes once. Without a vertex array object they are specified on every draw.
+	#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+		if (glGenVertexArrays != NULL && glBindVertexArray != NULL && glDeleteVertexArrays != NULL && has_gl_extension("GL_ARB_vertex_array_object")) {
+			glGenVertexArrays(1, &vertex_array);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glGenVertexArrays: %#04X", error); return false;}
+			glBindVertexArray(vertex_array);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glBindVertexArray: %#04X", error); return false;}
+			bool is_set = set_vertex_attributes(error_message);
+			glBindVertexArray(0);
+			if (!is_set) {
+				return false;
+			}
+		}
+	#endif
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer 0: %#04X", error); return false;}
+
+	return true;
+}
 
-	scale_uniform = glGetUniformLocation(shader_program, "scale");
+// Look up uniforms of a shader program used for this recording. The texture unit never changes and is set here.
+bool ScreenRecorder::get_program_locations(GLuint program, YuvProgram *yuv, char *error_message) {
+	yuv->program = program;
+
+	GLint tex_uniform = glGetUniformLocation(program, "tex0");
+	GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glGetUniformLocation tex0: %#04X", error); return false;}
+	// Previous planes and the current chroma planes of the active map program.
+	GLint tex1_uniform = glGetUniformLocation(program, "tex1");
+	error = glGetError(); if (error) {ERROR_MESSAGE("glGetUniformLocation tex1: %#04X", error); return false;}
+	GLint tex2_uniform = glGetUniformLocation(program, "tex2");
+	error = glGetError(); if (error) {ERROR_MESSAGE("glGetUniformLocation tex2: %#04X", error); return false;}
+	GLint tex3_uniform = glGetUniformLocation(program, "tex3");
+	error = glGetError(); if (error) {ERROR_MESSAGE("glGetUniformLocation tex3: %#04X", error); return false;}
+
+	yuv->scale_uniform = glGetUniformLocation(program, "scale");
 	error = glGetError(); if (error) ERROR_MESSAGE("glGetUniformLocation scale: %#04X", error);
 
-	resolution_uniform = glGetUniformLocation(shader_program, "resolution");
+	yuv->resolution_uniform = glGetUniformLocation(program, "resolution");
 	error = glGetError(); if (error) ERROR_MESSAGE("glGetUniformLocation resolution: %#04X", error);
 
-	// position attribute.
-	position_attrib = glGetAttribLocation(shader_program, "position");
-	error = glGetError(); if (error) {ERROR_MESSAGE("glGetAttribLocation position: %#04X", error); return false;}
-	glVertexAttribPointer(position_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glVertexAttribPointer position: %#04X", error); return false;}
-
-	// texcoord attribute.
-	texcoord_attrib = glGetAttribLocation(shader_program, "texcoord");
-	error = glGetError(); if (error) {ERROR_MESSAGE("glGetAttribLocation texcoord: %#04X", error); return false;}
-	glVertexAttribPointer(texcoord_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)(2 * sizeof(float)));
-	error = glGetError(); if (error) {ERROR_MESSAGE("glVertexAttribPointer texcoord: %#04X", error); return false;}
-
-	is_initialized = true;
+	// Force the first draw to set the uniforms.
+	yuv->scale[0] = yuv->scale[1] = -1.0f;
+	yuv->resolution[0] = yuv->resolution[1] = -1.0f;
 
-	#ifndef DM_PLATFORM_HTML5
-		thread_signal_init(&encoding_signal);
-		thread_signal_init(&encoding_done_signal);
-	#endif
+	glUseProgram(program);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glUseProgram: %#04X", error); return false;}
+	glUniform1i(tex_uniform, 0);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glUniform1i: %#04X", error); return false;}
+	if (tex1_uniform != -1) {
+		glUniform1i(tex1_uniform, 1);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glUniform1i tex1: %#04X", error); return false;}
+	}
+	if (tex2_uniform != -1) {
+		glUniform1i(tex2_uniform, 2);
+		glUniform1i(tex3_uniform, 3);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glUniform1i tex2: %#04X", error); return false;}
+	}
+	glUseProgram(0);
 
 	return true;
 }
 
-bool ScreenRecorder::start(char *error_message) {
-	frame_count = 0;
+// Parameters of the current recording the prepared resources depend on.
+void ScreenRecorder::get_resource_key(ResourceKey *key) {
+	// Keys are compared bytewise, padding must be zero.
+	memset(key, 0, sizeof(ResourceKey));
+	key->width = *capture_params.width;
+	key->height = *capture_params.height;
+	key->fps = *capture_params.fps;
+	key->bitrate = *capture_params.bitrate;
+	key->iframe = *capture_params.iframe;
+	key->temporal_layers = *capture_params.temporal_layers;
+	key->preset = *capture_params.preset;
+	key->settings.threads = *capture_params.threads;
+	key->settings.rate_control = *capture_params.rate_control;
+	key->settings.min_quantizer = *capture_params.min_quantizer;
+	key->settings.max_quantizer = *capture_params.max_quantizer;
+	key->settings.buffer_initial_size = *capture_params.buffer_initial_size;
+	key->settings.buffer_optimal_size = *capture_params.buffer_optimal_size;
+	key->settings.buffer_size = *capture_params.buffer_size;
+	key->settings.drop_frame_threshold = *capture_params.drop_frame_threshold;
+	key->settings.token_partitions = *capture_params.token_partitions;
+	// Speeds are set at every start.
+	key->settings.encoder_speed = 0;
+	key->settings.min_encoder_speed = 0;
+	key->conversion = *capture_params.conversion;
+	key->pbo_count = *capture_params.pbo_count;
+	key->texture_id = capture_params.texture_id;
+	key->is_headless = capture_params.is_headless;
+	key->async_encoding = *capture_params.async_encoding;
+	key->queue_size = *capture_params.queue_size;
+}
+
+// Create the GL targets, readback buffers, frame pool and encoder for the current parameters. They are kept after
+// the recording stops and reused by the next start() with the same parameters, so only a changed setup pays for
+// creating them. Can be called ahead of start() to move that cost out of the moment recording begins.
+bool ScreenRecorder::prepare(char *error_message) {
+	ResourceKey key;
+	get_resource_key(&key);
+	if (is_prepared && memcmp(&key, &prepared_key, sizeof(ResourceKey)) == 0) {
+		return true;
+	}
+	is_prepared = false;
+	if (is_encoder_ready) {
+		vpx_codec_destroy(&codec);
+		is_encoder_ready = false;
+	}
+	gl_validation = *capture_params.gl_validation;
+	is_gl_recheck = false;
+	is_active_map = false;
 	int width = *capture_params.width;
 	int height = *capture_params.height;
 
-	// Cleaning up here, because in the stop_thread it would crash.
-	if (glIsFramebuffer(fbo)) {
-		glDeleteFramebuffers(1, &fbo);
-		glDeleteBuffers(PBO_COUNT, pbo);
-		glDeleteTextures(1, &scaled_texture);
+	// Frames from CPU memory are always converted on the CPU. CPU conversion of render targets is not available on HTML5.
+	#ifdef DM_PLATFORM_HTML5
+		conversion = capture_params.is_headless ? CONVERSION_CPU : CONVERSION_GPU;
+	#else
+		conversion = capture_params.is_headless ? CONVERSION_CPU : *capture_params.conversion;
+	#endif
+	// The RGBA packed shader needs whole texels for each chroma row.
+	gpu_format = width % 8 == 0 && packed_shader_program != 0 ? GPU_FORMAT_RGBA : GPU_FORMAT_RGB;
+	if (conversion == CONVERSION_GPU_RGB) {
+		conversion = CONVERSION_GPU;
+		gpu_format = GPU_FORMAT_RGB;
+	} else if (conversion == CONVERSION_GPU_RGBA) {
+		conversion = CONVERSION_GPU;
+	} else if (luma_shader_program != 0 && width % 2 == 0 && height % 2 == 0) {
+		gpu_format = GPU_FORMAT_PLANAR;
 	}
-
-	glGenFramebuffers(1, &fbo);
-	GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glGenFramebuffers fbo: %#04X", error); return false;}
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer fbo: %#04X", error); return false;}
-	glGenTextures(1, &scaled_texture);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glGenTextures scaled_texture: %#04X", error); return false;}
-	glBindTexture(GL_TEXTURE_2D, scaled_texture);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindTexture scaled_texture: %#04X", error); return false;}
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glTexImage2D scaled_texture: %#04X", error); return false;}
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glTexParameteri scaled_texture: %#04X", error); return false;}
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glTexParameteri scaled_texture: %#04X", error); return false;}
-	glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, scaled_texture, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glFramebufferTexture2D fbo scaled_texture: %#04X", error); return false;}
-	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
-	if (status != GL_FRAMEBUFFER_COMPLETE) {ERROR_MESSAGE("glCheckFramebufferStatus: %#04X", error); return false;}
+	// Auto conversion is calibrated once, later recordings keep the faster backend.
+	calibration_frame = 0;
+	Stats empty_stats = {};
+	stats = empty_stats;
+	stats.conversion = conversion;
+	stats.cpu_kernel = yuv_converter.get_kernel_name();
 	#ifdef DM_PLATFORM_HTML5
-		pixels = new uint8_t[3 * 8 * width * height];
+		stats.readback = "read_pixels";
 	#else
-		GLenum draw_buffers[1] = {GL_COLOR_ATTACHMENT0};
-		glDrawBuffers(1, draw_buffers);
+		stats.readback = "none";
 	#endif
-	error = glGetError(); if (error) {ERROR_MESSAGE("glDrawBuffers: %#04X", error); return false;}
-	glBindTexture(GL_TEXTURE_2D, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindTexture 0: %#04X", error); return false;}
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer 0: %#04X", error); return false;}
 
-	#ifndef DM_PLATFORM_HTML5
-		pbo_index = 0;
-		is_pbo_full = false;
-		glGenBuffers(PBO_COUNT, pbo);
-		error = glGetError(); if (error) {ERROR_MESSAGE("glGenBuffers pbo: %#04X", error); return false;}
-		for (int i = 0; i < PBO_COUNT; ++i) {
-			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
-			error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer pbo[%d]: %#04X", i, error); return false;}
-			glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 3, NULL, GL_STREAM_READ);
-			error = glGetError(); if (error) {ERROR_MESSAGE("glBufferData %d: %#04X", i, error); return false;}
-		}
-		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-		error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer 0: %#04X", error); return false;}
-	#endif
+	if (!capture_params.is_headless && !start_gl(error_message)) {
+		return false;
+	}
+	// Planar targets may have fallen back to a packed format.
+	static const char *gpu_format_names[] = {"rgb", "rgba", "planar"};
+	stats.gpu_format = gpu_format_names[gpu_format];
+
+	// One frame is being encoded while the rest wait in the encode queue.
+	int pool_size = *capture_params.async_encoding ? *capture_params.queue_size + 1 : 1;
+	if (!frame_pool.init(get_frame_size(), pool_size)) {
+		ERROR_MESSAGE("Failed to allocate %d frames.", pool_size);
+		return false;
+	}
 
-	if (!vpx_img_alloc(&image, VPX_IMG_FMT_I420, width, height, 1)) {
+	if (!vpx_img_wrap(&image, VPX_IMG_FMT_I420, width, height, 1, frame_pool.get_frame(0))) {
 		ERROR_MESSAGE("Failed to allocate image.");
 		return false;
 	}
@@ -421,49 +904,193 @@ bool ScreenRecorder::start(char *error_message) {
 
 	encoder_config.g_w = width;
 	encoder_config.g_h = height;
+	// Millisecond timebase, matches the timecode scale of the WebM file.
 	encoder_config.g_timebase.num = 1;
-	encoder_config.g_timebase.den = *capture_params.fps;
+	encoder_config.g_timebase.den = 1000;
 	encoder_config.rc_target_bitrate = *capture_params.bitrate;
 	#ifdef DM_PLATFORM_HTML5
 		encoder_config.g_threads = 0;
 	#else
-		encoder_config.g_threads = 4;
+		encoder_config.g_threads = *capture_params.threads;
 	#endif
 	encoder_config.g_pass = VPX_RC_ONE_PASS;
-	encoder_config.rc_end_usage = VPX_VBR;
+	encoder_config.rc_end_usage = (vpx_rc_mode)*capture_params.rate_control;
+	// Internal resolution is lowered by the load governor, it would fight libvpx's own resizing in CBR mode.
 	encoder_config.rc_resize_allowed = 0;
-	encoder_config.rc_min_quantizer = 2;
-	encoder_config.rc_max_quantizer = 50;
-	encoder_config.rc_buf_initial_sz = 4000;
-	encoder_config.rc_buf_optimal_sz = 5000;
-	encoder_config.rc_buf_sz = 6000;
-	encoder_config.rc_dropframe_thresh = 25;
+	encoder_config.rc_min_quantizer = *capture_params.min_quantizer;
+	encoder_config.rc_max_quantizer = *capture_params.max_quantizer;
+	encoder_config.rc_buf_initial_sz = *capture_params.buffer_initial_size;
+	encoder_config.rc_buf_optimal_sz = *capture_params.buffer_optimal_size;
+	encoder_config.rc_buf_sz = *capture_params.buffer_size;
+	encoder_config.rc_dropframe_thresh = *capture_params.drop_frame_threshold;
 	encoder_config.kf_mode = VPX_KF_AUTO;
 	encoder_config.kf_max_dist = *capture_params.iframe * *capture_params.fps;
+	if (*capture_params.temporal_layers) {
+		// Every other frame is in the enhancement layer, the base layer gets 60% of the bitrate.
+		encoder_config.ts_number_layers = TEMPORAL_LAYERS;
+		encoder_config.ts_periodicity = TEMPORAL_LAYERS;
+		encoder_config.ts_layer_id[0] = 0;
+		encoder_config.ts_layer_id[1] = 1;
+		encoder_config.ts_rate_decimator[0] = 2;
+		encoder_config.ts_rate_decimator[1] = 1;
+		encoder_config.ts_target_bitrate[0] = encoder_config.rc_target_bitrate * 3 / 5;
+		encoder_config.ts_target_bitrate[1] = encoder_config.rc_target_bitrate;
+		// Otherwise golden frame updates and probability updates land on enhancement layer frames too.
+		encoder_config.g_error_resilient = VPX_ERROR_RESILIENT_DEFAULT;
+	}
 
 	if (vpx_codec_enc_init(&codec, codec_interface, &encoder_config, 0)) {
 		ERROR_MESSAGE("Failed to initialize encoder: %s", codec.err_detail);
 		return false;
 	}
+	is_encoder_ready = true;
+	// Each thread codes the macroblock rows of its own token partition.
+	int token_partitions = VP8_ONE_TOKENPARTITION;
+	while ((1 << token_partitions) < *capture_params.token_partitions) {
+		++token_partitions;
+	}
+	if (vpx_codec_control(&codec, VP8E_SET_TOKEN_PARTITIONS, token_partitions)) {
+		ERROR_MESSAGE("Failed to set token partitions: %s", vpx_codec_error(&codec));
+		return false;
+	}
+	pts_offset = 0;
+	next_pts_offset = 0;
+	thread_atomic_int_store(&encoder_scale, VP8E_NORMAL);
+
+	delete []roi_map;
+	roi_map = new uint8_t[((width + 15) / 16) * ((height + 15) / 16)];
+	delete []scaled_active_map;
+	scaled_active_map = NULL;
+	if (is_active_map) {
+		scaled_active_map = new uint8_t[get_active_map_size()];
+	}
+
+	prepared_key = key;
+	is_prepared = true;
+	return true;
+}
+
+bool ScreenRecorder::start(char *error_message) {
+	if (!prepare(error_message)) {
+		return false;
+	}
+	frame_count = 0;
+	last_timestamp = -1;
+	frame_interval = 1000000 / *capture_params.fps;
+	has_frame_hash = false;
+	static_end_timestamp = -1;
+	thread_atomic_int_store(&static_frames, 0);
+	layer_frame_count = 0;
+	thread_atomic_int_store(&layer_dropped_frames, 0);
+	gl_validation = *capture_params.gl_validation;
+	is_gl_recheck = false;
+	is_previous_planes_valid = false;
+	active_map_id = 0;
+	encoded_active_map_id = 0;
+	is_last_frame_reference = false;
+	int width = *capture_params.width;
+	int height = *capture_params.height;
+
+	// Counters start over, the backends and formats of the prepared resources stay.
+	Stats empty_stats = {};
+	empty_stats.conversion = stats.conversion;
+	empty_stats.cpu_kernel = stats.cpu_kernel;
+	empty_stats.readback = stats.readback;
+	empty_stats.gpu_format = stats.gpu_format;
+	stats = empty_stats;
+
+	if (!capture_params.is_headless) {
+		set_debug_output(gl_validation == GL_VALIDATION_VERBOSE);
+		#ifndef DM_PLATFORM_HTML5
+			// Readbacks left over from the previous recording are discarded.
+			reset_pixel_buffers();
+			if (source_fbo != 0 && !texture_yuv_converter.init(width, height, source_texture_width, source_texture_height, *capture_params.x_scale, *capture_params.y_scale)) {
+				ERROR_MESSAGE("Failed to initialize YUV converter for %dx%d render target.", source_texture_width, source_texture_height);
+				return false;
+			}
+		#endif
+	}
+	if (!yuv_converter.init(width, height, *capture_params.source_width, *capture_params.source_height, *capture_params.x_scale, *capture_params.y_scale)) {
+		ERROR_MESSAGE("Failed to initialize YUV converter.");
+		return false;
+	}
+
+	// A reused encoder continues its timestamps after the previous recording and starts the new one with a keyframe.
+	pts_offset = next_pts_offset;
+	is_keyframe_forced = true;
+	// The encoding thread is not running yet. Speed is set explicitly, so libvpx does not pick it on its own.
+	average_encode_time = 0;
+	adjustment_frames = 0;
+	thread_mutex_lock(&resolution_changes_mutex);
+	resolution_change_count = 0;
+	thread_mutex_unlock(&resolution_changes_mutex);
+	thread_atomic_int_store(&encoder_speed, *capture_params.encoder_speed);
+	thread_atomic_int_store(&encode_time, 0);
+	for (int i = 0; i < ENCODE_TIME_BUCKETS; ++i) {
+		thread_atomic_int_store(&encode_time_histogram[i], 0);
+	}
+	if (vpx_codec_control(&codec, VP8E_SET_CPUUSED, -*capture_params.encoder_speed)) {
+		ERROR_MESSAGE("Failed to set encoder speed: %s", vpx_codec_error(&codec));
+		return false;
+	}
+	if (thread_atomic_int_load(&encoder_scale) != VP8E_NORMAL) {
+		vpx_scaling_mode_t mode = {VP8E_NORMAL, VP8E_NORMAL};
+		if (vpx_codec_control(&codec, VP8E_SET_SCALEMODE, &mode) || vpx_codec_enc_config_set(&codec, &encoder_config)) {
+			ERROR_MESSAGE("Failed to reset encoder scale: %s", vpx_codec_error(&codec));
+			return false;
+		}
+		thread_atomic_int_store(&encoder_scale, VP8E_NORMAL);
+	}
+	// Active map of the previous recording is not relative to the first frame.
+	if (is_active_map) {
+		vpx_active_map_t active_map = {NULL, (unsigned int)active_map_rows, (unsigned int)active_map_cols};
+		vpx_codec_control(&codec, VP8E_SET_ACTIVEMAP, &active_map);
+	}
+
+	// Regions set before the start apply to the first frame.
+	set_roi_map();
+	thread_atomic_int_store(&is_roi_map_changed, 0);
 
 	if (capture_params.duration != NULL) {
 		circular_buffer = new CircularBuffer();
-		double duration = *capture_params.duration + *capture_params.iframe; // Increase duration by keyframe interval.
-		size_t buffer_size = 1.5 * duration * (*capture_params.bitrate / 8); // Allocate enough memory for frames, plus a bit more for bitrate fluctuation.
-		if (!circular_buffer->init(buffer_size, duration * *capture_params.fps)) {
-			ERROR_MESSAGE("Failed to initialize circular encoder, requested %zu bytes.", buffer_size);
+		// Pages grow on demand. By default the buffer may take twice the size of the frames of the duration plus the
+		// keyframe interval at the target bitrate, headroom for bitrate peaks and the GOP kept before the window.
+		size_t memory_limit = 0;
+		if (capture_params.replay_memory_limit != NULL) {
+			memory_limit = *capture_params.replay_memory_limit * 1024 * 1024;
+		} else {
+			double duration = *capture_params.duration + *capture_params.iframe;
+			memory_limit = 2 * duration * (*capture_params.bitrate / 8);
+		}
+		// A page holds a few dozen average frames, so large keyframes fit and the space left at the end of a page is small.
+		size_t page_size = 32 * (*capture_params.bitrate / 8) / *capture_params.fps;
+		if (page_size < MIN_REPLAY_PAGE_SIZE) {
+			page_size = MIN_REPLAY_PAGE_SIZE;
+		}
+		page_size = (page_size + REPLAY_PAGE_ALIGNMENT - 1) / REPLAY_PAGE_ALIGNMENT * REPLAY_PAGE_ALIGNMENT;
+		thread_atomic_int_store(&replay_memory, 0);
+		thread_atomic_int_store(&replay_peak_memory, 0);
+		// Frames are kept by timestamp, the keyframe interval is only the lead-in to the first keyframe.
+		if (!circular_buffer->init(memory_limit, page_size, (int64_t)(*capture_params.duration * 1000), capture_params.replay_file)) {
+			if (capture_params.replay_file != NULL) {
+				ERROR_MESSAGE("Failed to initialize circular encoder in %zu bytes of %s.", memory_limit, capture_params.replay_file);
+			} else {
+				ERROR_MESSAGE("Failed to initialize circular encoder, up to %zu bytes in pages of %zu bytes.", memory_limit, page_size);
+			}
 			return false;
 		}
 	}
 
-	if (!webm_writer.open(capture_params.filename, width, height, *capture_params.fps)) {
+	if (!webm_writer.open(capture_params.filename, width, height)) {
 		ERROR_MESSAGE("Failed to open %s for writing.", capture_params.filename);
 		return false;
 	}
 
-	should_encoding_thread_exit = false;
-	is_enconding_thread_available = true;
 	if (*capture_params.async_encoding) {
+		if (!encode_queue.init(&frame_pool, *capture_params.queue_size, *capture_params.queue_policy)) {
+			ERROR_MESSAGE("Failed to initialize encode queue of %d frames.", *capture_params.queue_size);
+			return false;
+		}
 		encoding_thread = thread_create(encoding_thread_proc, this, "Encoding thread", THREAD_STACK_SIZE_DEFAULT);
 	} else {
 		encoding_thread = NULL;
@@ -472,171 +1099,966 @@ bool ScreenRecorder::start(char *error_message) {
 	return true;
 }
 
-// Draw the quad model with retrived texture from Defold's render target, capture the output as YUV video frame and
-// pass it into the video encoder.
-bool ScreenRecorder::capture_frame(char *error_message) {
-	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-	GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer fbo: %#04X", error); return false;}
-
-	glViewport(0, 0, *capture_params.width, *capture_params.height);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glViewport: %#04X", error); return false;}
-
-	glClearColor(0.0, 0.0, 0.0, 1.0);
-	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-
-	glUseProgram(shader_program);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glUseProgram: %#04X", error); return false;}
-
-	glActiveTexture(GL_TEXTURE0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glActiveTexture: %#04X", error); return false;}
-	glBindTexture(GL_TEXTURE_2D, capture_params.texture_id);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindTexture capture_params.texture_id: %#04X", error); return false;}
-	glUniform1i(tex_uniform, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glUniform1i: %#04X", error); return false;}
-
-	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer: %#04X", error); return false;}
-	glBufferData(GL_ARRAY_BUFFER, sizeof(quad_model), quad_model, GL_STATIC_DRAW);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBufferData: %#04X", error); return false;}
-
-	glVertexAttribPointer(position_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glVertexAttribPointer position: %#04X", error); return false;}
-	glVertexAttribPointer(texcoord_attrib, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)(2 * sizeof(float)));
-	error = glGetError(); if (error) {ERROR_MESSAGE("glVertexAttribPointer texcoord: %#04X", error); return false;}
-
-	glEnableVertexAttribArray(position_attrib);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glEnableVertexAttribArray position_attrib: %#04X", error); return false;}
-
-	glEnableVertexAttribArray(texcoord_attrib);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glEnableVertexAttribArray texcoord_attrib: %#04X", error); return false;}
-
-	glUniform2f(scale_uniform, *capture_params.x_scale, *capture_params.y_scale);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glUniform2f scale: %#04X", error); return false;}
-
-	glUniform2f(resolution_uniform, *capture_params.width, *capture_params.height);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glUniform2f resolution: %#04X", error); return false;}
-
-	glDrawArrays(GL_TRIANGLES, 0, 6);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glDrawArrays: %#04X", error); return false;}
-
-	glBindTexture(GL_TEXTURE_2D, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindTexture 0: %#04X", error); return false;}
+bool ScreenRecorder::start_gl(char *error_message) {
+	int width = *capture_params.width;
+	int height = *capture_params.height;
 
-	glDisableVertexAttribArray(position_attrib);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glDisableVertexAttribArray position_attrib: %#04X", error); return false;}
-	glDisableVertexAttribArray(texcoord_attrib);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glDisableVertexAttribArray texcoord_attrib: %#04X", error); return false;}
+	// Cleaning up here, because in the stop_thread it would crash.
+	delete_yuv_targets();
+	#ifndef DM_PLATFORM_HTML5
+		delete_pixel_buffers();
+	#endif
+	if (glIsFramebuffer(source_fbo)) {
+		glDeleteFramebuffers(1, &source_fbo);
+		source_fbo = 0;
+	}
 
-	glUseProgram(0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glUseProgram 0: %#04X", error); return false;}
+	set_debug_output(gl_validation == GL_VALIDATION_VERBOSE);
 
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer 0: %#04X", error); return false;}
-	
+	if (!create_yuv_targets(error_message)) {
+		if (gpu_format != GPU_FORMAT_PLANAR) {
+			return false;
+		}
+		// R8 textures or multiple render targets are not supported, use a packed format.
+		dmLogInfo("Planar YUV targets are not available, falling back to a packed format: %s", error_message);
+		delete_yuv_targets();
+		clear_gl_errors();
+		gpu_format = width % 8 == 0 && packed_shader_program != 0 ? GPU_FORMAT_RGBA : GPU_FORMAT_RGB;
+		if (!create_yuv_targets(error_message)) {
+			return false;
+		}
+	}
 	#ifdef DM_PLATFORM_HTML5
-		int w = *capture_params.width;
-		int h = *capture_params.height;
-		glReadPixels(0, 0, w, h / 2, GL_RGB, GL_UNSIGNED_BYTE, pixels);
-		error = glGetError(); if (error) {ERROR_MESSAGE("glReadPixels: %#04X", error); return false;}
-		image.planes[0] = pixels; // Y frame.
-		image.planes[1] = image.planes[0] + w * h; // U frame.
-		image.planes[2] = image.planes[1] + w * h / 4; // V frame.
-		encode_frame(false);
-	#else
-		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[pbo_index]);
-		error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer GL_PIXEL_PACK_BUFFER: %#04X", error); return false;}
+		delete []pixels;
+		pixels = new uint8_t[3 * 8 * width * height];
+	#endif
 
-		GLint is_mapped = GL_FALSE;
-		glGetBufferParameteriv(GL_PIXEL_PACK_BUFFER, GL_BUFFER_MAPPED, &is_mapped);
-		if (is_mapped) {
-			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
-			error = glGetError(); if (error) {ERROR_MESSAGE("glUnmapBuffer GL_PIXEL_PACK_BUFFER: %#04X", error); return false;}
+	GLuint program = shader_program;
+	if (gpu_format == GPU_FORMAT_RGBA) {
+		program = packed_shader_program;
+	} else if (gpu_format == GPU_FORMAT_PLANAR) {
+		program = luma_shader_program;
+		if (!get_program_locations(chroma_shader_program, &chroma_program, error_message)) {
+			return false;
 		}
+	}
+	if (!get_program_locations(program, &yuv_program, error_message)) {
+		return false;
+	}
 
-		glReadPixels(0, 0, *capture_params.width, *capture_params.height / 2, GL_RGB, GL_UNSIGNED_BYTE, 0);
-		error = glGetError(); if (error) {ERROR_MESSAGE("glReadPixels: %#04X", error); return false;}
-
-		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-		error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer GL_PIXEL_PACK_BUFFER 0: %#04X", error); return false;}
+	#ifndef DM_PLATFORM_HTML5
+		// The active map compares Y, U and V planes, it needs the planar format.
+		if (gpu_format == GPU_FORMAT_PLANAR && conversion != CONVERSION_CPU && active_map_shader_program != 0) {
+			is_active_map = create_active_map_target(error_message) && get_program_locations(active_map_shader_program, &active_map_program, error_message);
+			if (!is_active_map) {
+				dmLogInfo("Active map is not available, every macroblock is encoded: %s", error_message);
+				clear_gl_errors();
+			}
+		}
 	#endif
 
-	glBindFramebuffer(GL_FRAMEBUFFER, 0);
-	error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer 0: %#04X", error); return false;}
-
 	#ifndef DM_PLATFORM_HTML5
-		if (is_pbo_full) {
-			if (*capture_params.async_encoding && !is_enconding_thread_available) {
-				thread_signal_wait(&encoding_done_signal, THREAD_SIGNAL_WAIT_INFINITE);
-			}
-			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[(pbo_index + 1) % PBO_COUNT]);
-			int w = *capture_params.width;
-			int h = *capture_params.height;
-			//GLubyte *pixels = (GLubyte *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 1.5 * w * h, GL_MAP_READ_BIT);
-			GLubyte *pixels = (GLubyte *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
-			error = glGetError(); if (error) {ERROR_MESSAGE("glMapBuffer: %#04X", error); return false;}
-			if (pixels) {
-				image.planes[0] = pixels; // Y frame.
-				image.planes[1] = image.planes[0] + w * h; // U frame.
-				image.planes[2] = image.planes[1] + w * h / 4; // V frame.
-				if (*capture_params.async_encoding) {
-					// Signal encoding thread to start encoding.
-					thread_signal_raise(&encoding_signal);
-				} else {
-					encode_frame(false);
-				}
+		GLenum error;
+		GLenum status;
+		// CPU conversion reads the render target's texture directly.
+		int pbo_size = width * height * 3;
+		if (conversion != CONVERSION_GPU) {
+			glBindTexture(GL_TEXTURE_2D, capture_params.texture_id);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &source_texture_width);
+			glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &source_texture_height);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glGetTexLevelParameteriv: %#04X", error); return false;}
+			glBindTexture(GL_TEXTURE_2D, 0);
+			glGenFramebuffers(1, &source_fbo);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glGenFramebuffers source_fbo: %#04X", error); return false;}
+			glBindFramebuffer(GL_FRAMEBUFFER, source_fbo);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer source_fbo: %#04X", error); return false;}
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, capture_params.texture_id, 0);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glFramebufferTexture2D source_fbo: %#04X", error); return false;}
+			status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+			if (status != GL_FRAMEBUFFER_COMPLETE) {ERROR_MESSAGE("glCheckFramebufferStatus source_fbo: %#04X", status); return false;}
+			glBindFramebuffer(GL_FRAMEBUFFER, 0);
+			if (4 * source_texture_width * source_texture_height > pbo_size) {
+				pbo_size = 4 * source_texture_width * source_texture_height;
 			}
-			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
-		} else if (pbo_index == PBO_COUNT - 1) {
-			is_pbo_full = true;
 		}
 
-		pbo_index = (pbo_index + 1) % PBO_COUNT;
+		// Readbacks are fenced, a buffer is mapped only after the GPU has finished writing it.
+		#ifdef DM_PLATFORM_OSX
+			is_fence_available = true;
+		#else
+			is_fence_available = glFenceSync != NULL && glClientWaitSync != NULL && glDeleteSync != NULL;
+		#endif
+		// Buffers stay mapped for the whole recording when possible. Relies on fences to know when data has arrived.
+		is_persistent_mapping = false;
+		#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+			is_persistent_mapping = is_fence_available && glBufferStorage != NULL && glMapBufferRange != NULL && has_gl_extension("GL_ARB_buffer_storage");
+		#endif
+		if (is_persistent_mapping && !create_pixel_buffers(pbo_size, error_message)) {
+			dmLogInfo("Persistent mapping of readback buffers failed, falling back to glMapBuffer: %s", error_message);
+			delete_pixel_buffers();
+			clear_gl_errors();
+			is_persistent_mapping = false;
+		}
+		if (!is_persistent_mapping && !create_pixel_buffers(pbo_size, error_message)) {
+			return false;
+		}
+		stats.readback = is_persistent_mapping ? "persistent" : "map";
 	#endif
+
 	return true;
 }
 
-bool ScreenRecorder::stop(char *error_message) {
-	if (encoding_thread != NULL) {
-		dmLogDebug("Finishing encoding thread.");
-		// Finish encoding thread.
-		should_encoding_thread_exit = true;
-		thread_signal_raise(&encoding_signal);
-		thread_join(encoding_thread);
-		thread_destroy(encoding_thread);
-		dmLogDebug("Finished encoding thread.");
-		encoding_thread = NULL;
+// Route GL errors to the log through KHR_debug. Synchronous output makes the message appear right after the failing call.
+void ScreenRecorder::set_debug_output(bool is_enabled) {
+	#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+		if (is_enabled == is_debug_output || glDebugMessageCallback == NULL || !has_gl_extension("GL_KHR_debug")) {
+			return;
+		}
+		if (is_enabled) {
+			glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
+			glDebugMessageCallback(gl_debug_callback, NULL);
+			glEnable(GL_DEBUG_OUTPUT);
+		} else {
+			glDisable(GL_DEBUG_OUTPUT);
+			glDebugMessageCallback(NULL, NULL);
+		}
+		clear_gl_errors();
+		is_debug_output = is_enabled;
+	#else
+		(void)is_enabled;
+	#endif
+}
+
+// Allocate a linear filtered texture and attach it to the bound framebuffer.
+static bool create_target_texture(GLuint *texture, GLint internal_format, GLenum format, int width, int height, GLenum attachment, char *error_message) {
+	glGenTextures(1, texture);
+	GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glGenTextures: %#04X", error); return false;}
+	glBindTexture(GL_TEXTURE_2D, *texture);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glBindTexture: %#04X", error); return false;}
+	glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, GL_UNSIGNED_BYTE, 0);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glTexImage2D %dx%d: %#04X", width, height, error); return false;}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glTexParameteri: %#04X", error); return false;}
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glTexParameteri: %#04X", error); return false;}
+	glFramebufferTexture2D(GL_FRAMEBUFFER, attachment, GL_TEXTURE_2D, *texture, 0);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glFramebufferTexture2D: %#04X", error); return false;}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glBindTexture 0: %#04X", error); return false;}
+	return true;
+}
+
+// Render targets of the GPU conversion for the current format. Planar format renders Y into a full resolution R8
+// texture and U, V into two half resolution R8 textures of a second framebuffer.
+bool ScreenRecorder::create_yuv_targets(char *error_message) {
+	int width = *capture_params.width;
+	int height = *capture_params.height;
+
+	glGenFramebuffers(1, &fbo);
+	GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glGenFramebuffers fbo: %#04X", error); return false;}
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer fbo: %#04X", error); return false;}
+	bool is_created;
+	if (gpu_format == GPU_FORMAT_RGBA) {
+		is_created = create_target_texture(&scaled_texture, GL_RGBA, GL_RGBA, width / 4, height * 3 / 2, GL_COLOR_ATTACHMENT0, error_message);
+	#ifndef DM_PLATFORM_HTML5
+	} else if (gpu_format == GPU_FORMAT_PLANAR) {
+		is_created = create_target_texture(&scaled_texture, GL_R8, GL_RED, width, height, GL_COLOR_ATTACHMENT0, error_message);
+	#endif
+	} else {
+		is_created = create_target_texture(&scaled_texture, GL_RGB, GL_RGB, width, height, GL_COLOR_ATTACHMENT0, error_message);
+	}
+	if (!is_created) {
+		return false;
+	}
+	GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+	if (status != GL_FRAMEBUFFER_COMPLETE) {ERROR_MESSAGE("glCheckFramebufferStatus: %#04X", status); return false;}
+	#ifndef DM_PLATFORM_HTML5
+		GLenum draw_buffers[2] = {GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1};
+		glDrawBuffers(1, draw_buffers);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glDrawBuffers: %#04X", error); return false;}
+
+		if (gpu_format == GPU_FORMAT_PLANAR) {
+			glGenFramebuffers(1, &chroma_fbo);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glGenFramebuffers chroma_fbo: %#04X", error); return false;}
+			glBindFramebuffer(GL_FRAMEBUFFER, chroma_fbo);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer chroma_fbo: %#04X", error); return false;}
+			if (!create_target_texture(&u_texture, GL_R8, GL_RED, width / 2, height / 2, GL_COLOR_ATTACHMENT0, error_message)
+				|| !create_target_texture(&v_texture, GL_R8, GL_RED, width / 2, height / 2, GL_COLOR_ATTACHMENT1, error_message)) {
+				return false;
+			}
+			glDrawBuffers(2, draw_buffers);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glDrawBuffers chroma_fbo: %#04X", error); return false;}
+			status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+			if (status != GL_FRAMEBUFFER_COMPLETE) {ERROR_MESSAGE("glCheckFramebufferStatus chroma_fbo: %#04X", status); return false;}
+		}
+	#endif
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer 0: %#04X", error); return false;}
+	return true;
+}
+
+#ifndef DM_PLATFORM_HTML5
+	// Mask target with one texel per macroblock and a copy of the previous frame's planes to compare against, the Y
+	// plane on top and the U and V planes side by side below it.
+	bool ScreenRecorder::create_active_map_target(char *error_message) {
+		int width = *capture_params.width;
+		int height = *capture_params.height;
+		active_map_cols = (width + 15) / 16;
+		active_map_rows = (height + 15) / 16;
+
+		glGenFramebuffers(1, &active_map_fbo);
+		GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glGenFramebuffers active_map_fbo: %#04X", error); return false;}
+		glBindFramebuffer(GL_FRAMEBUFFER, active_map_fbo);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer active_map_fbo: %#04X", error); return false;}
+		if (!create_target_texture(&active_map_texture, GL_R8, GL_RED, active_map_cols, active_map_rows, GL_COLOR_ATTACHMENT0, error_message)) {
+			return false;
+		}
+		GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+		if (status != GL_FRAMEBUFFER_COMPLETE) {ERROR_MESSAGE("glCheckFramebufferStatus active_map_fbo: %#04X", status); return false;}
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glBindFramebuffer 0: %#04X", error); return false;}
+
+		glGenTextures(1, &previous_planes_texture);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glGenTextures previous_planes_texture: %#04X", error); return false;}
+		glBindTexture(GL_TEXTURE_2D, previous_planes_texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_R8, width, height * 3 / 2, 0, GL_RED, GL_UNSIGNED_BYTE, 0);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glTexImage2D previous_planes_texture %dx%d: %#04X", width, height * 3 / 2, error); return false;}
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glTexParameteri previous_planes_texture: %#04X", error); return false;}
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return true;
+	}
+#endif
+
+void ScreenRecorder::delete_yuv_targets() {
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	if (glIsFramebuffer(fbo)) {
+		glDeleteFramebuffers(1, &fbo);
+	}
+	if (glIsFramebuffer(chroma_fbo)) {
+		glDeleteFramebuffers(1, &chroma_fbo);
+	}
+	if (glIsFramebuffer(active_map_fbo)) {
+		glDeleteFramebuffers(1, &active_map_fbo);
+	}
+	GLuint textures[5] = {scaled_texture, u_texture, v_texture, active_map_texture, previous_planes_texture};
+	glDeleteTextures(5, textures);
+	fbo = 0;
+	chroma_fbo = 0;
+	active_map_fbo = 0;
+	scaled_texture = 0;
+	u_texture = 0;
+	v_texture = 0;
+	active_map_texture = 0;
+	previous_planes_texture = 0;
+}
+
+#ifndef DM_PLATFORM_HTML5
+	bool ScreenRecorder::create_pixel_buffers(int size, char *error_message) {
+		pbo_count = *capture_params.pbo_count;
+		pbo_head = 0;
+		pbo_pending = 0;
+		pbo = new GLuint[pbo_count];
+		pbo_conversion = new int[pbo_count];
+		pbo_timestamps = new int64_t[pbo_count];
+		pbo_active_map_ids = new uint32_t[pbo_count];
+		pbo_active_map_valid = new bool[pbo_count];
+		pbo_fences = new GLsync[pbo_count];
+		pbo_pointers = new GLubyte *[pbo_count];
+		for (int i = 0; i < pbo_count; ++i) {
+			pbo_fences[i] = 0;
+			pbo_pointers[i] = NULL;
+		}
+		glGenBuffers(pbo_count, pbo);
+		GLenum error = glGetError(); if (error) {ERROR_MESSAGE("glGenBuffers pbo: %#04X", error); return false;}
+		for (int i = 0; i < pbo_count; ++i) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[i]);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer pbo[%d]: %#04X", i, error); return false;}
+			#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+				if (is_persistent_mapping) {
+					GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+					glBufferStorage(GL_PIXEL_PACK_BUFFER, size, NULL, flags | GL_CLIENT_STORAGE_BIT);
+					error = glGetError(); if (error) {ERROR_MESSAGE("glBufferStorage %d: %#04X", i, error); return false;}
+					pbo_pointers[i] = (GLubyte *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, size, flags);
+					error = glGetError(); if (error || pbo_pointers[i] == NULL) {ERROR_MESSAGE("glMapBufferRange %d: %#04X", i, error); return false;}
+					continue;
+				}
+			#endif
+			glBufferData(GL_PIXEL_PACK_BUFFER, size, NULL, GL_STREAM_READ);
+			error = glGetError(); if (error) {ERROR_MESSAGE("glBufferData %d: %#04X", i, error); return false;}
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		error = glGetError(); if (error) {ERROR_MESSAGE("glBindBuffer 0: %#04X", error); return false;}
+		return true;
+	}
+
+	// Forget pending readbacks, the buffers are written again from the first one.
+	void ScreenRecorder::reset_pixel_buffers() {
+		for (int i = 0; i < pbo_count && pbo != NULL; ++i) {
+			if (pbo_fences[i] != 0) {
+				glDeleteSync(pbo_fences[i]);
+				pbo_fences[i] = 0;
+			}
+		}
+		pbo_head = 0;
+		pbo_pending = 0;
+	}
+
+	// Persistently mapped buffers are unmapped by deletion.
+	void ScreenRecorder::delete_pixel_buffers() {
+		if (pbo == NULL) {
+			return;
+		}
+		for (int i = 0; i < pbo_count; ++i) {
+			if (pbo_fences[i] != 0) {
+				glDeleteSync(pbo_fences[i]);
+			}
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		glDeleteBuffers(pbo_count, pbo);
+		delete []pbo;
+		delete []pbo_conversion;
+		delete []pbo_timestamps;
+		delete []pbo_active_map_ids;
+		delete []pbo_active_map_valid;
+		delete []pbo_fences;
+		delete []pbo_pointers;
+		pbo = NULL;
+		pbo_conversion = NULL;
+		pbo_timestamps = NULL;
+		pbo_active_map_ids = NULL;
+		pbo_active_map_valid = NULL;
+		pbo_fences = NULL;
+		pbo_pointers = NULL;
+	}
+#endif
+
+// Point the vertex attributes to the quad model.
+bool ScreenRecorder::set_vertex_attributes(char *error_message) {
+	glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+	CHECK_GL_ERROR("glBindBuffer");
+
+	glVertexAttribPointer(POSITION_ATTRIB, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)0);
+	CHECK_GL_ERROR("glVertexAttribPointer position");
+	glEnableVertexAttribArray(POSITION_ATTRIB);
+	CHECK_GL_ERROR("glEnableVertexAttribArray position");
+
+	glVertexAttribPointer(TEXCOORD_ATTRIB, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void *)(2 * sizeof(float)));
+	CHECK_GL_ERROR("glVertexAttribPointer texcoord");
+	glEnableVertexAttribArray(TEXCOORD_ATTRIB);
+	CHECK_GL_ERROR("glEnableVertexAttribArray texcoord");
+
+	return true;
+}
+
+// Uniforms are kept by the program between frames, only changed values are set. Expects the program to be in use.
+bool ScreenRecorder::set_uniforms(YuvProgram *yuv, char *error_message) {
+	GLfloat x_scale = *capture_params.x_scale;
+	GLfloat y_scale = *capture_params.y_scale;
+	if (yuv->scale[0] != x_scale || yuv->scale[1] != y_scale) {
+		glUniform2f(yuv->scale_uniform, x_scale, y_scale);
+		CHECK_GL_ERROR("glUniform2f scale");
+		yuv->scale[0] = x_scale;
+		yuv->scale[1] = y_scale;
+	}
+
+	GLfloat width = *capture_params.width;
+	GLfloat height = *capture_params.height;
+	if (yuv->resolution[0] != width || yuv->resolution[1] != height) {
+		glUniform2f(yuv->resolution_uniform, width, height);
+		CHECK_GL_ERROR("glUniform2f resolution");
+		yuv->resolution[0] = width;
+		yuv->resolution[1] = height;
+	}
+
+	return true;
+}
+
+// Draw the quad model with the texture into the bound framebuffer. The quad covers the whole viewport, so the target
+// is not cleared.
+bool ScreenRecorder::draw_quad(YuvProgram *yuv, GLuint texture, char *error_message) {
+	glUseProgram(yuv->program);
+	CHECK_GL_ERROR("glUseProgram");
+
+	glActiveTexture(GL_TEXTURE0);
+	CHECK_GL_ERROR("glActiveTexture");
+	glBindTexture(GL_TEXTURE_2D, texture);
+	CHECK_GL_ERROR("glBindTexture");
+
+	#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+		if (vertex_array != 0) {
+			glBindVertexArray(vertex_array);
+			CHECK_GL_ERROR("glBindVertexArray");
+		}
+	#endif
+	if (vertex_array == 0 && !set_vertex_attributes(error_message)) {
+		return false;
 	}
-	// Flush encoder.
-	while (encode_frame(true)) {
+
+	if (!set_uniforms(yuv, error_message)) {
+		return false;
 	}
-	vpx_img_free(&image);
-	if (vpx_codec_destroy(&codec)) {
-		ERROR_MESSAGE("Failed to destroy codec.");
+
+	glDrawArrays(GL_TRIANGLES, 0, 6);
+	CHECK_GL_ERROR("glDrawArrays");
+
+	// Leave Defold's vertex state as it was.
+	#if defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS)
+		if (vertex_array != 0) {
+			glBindVertexArray(0);
+			CHECK_GL_ERROR("glBindVertexArray 0");
+		}
+	#endif
+	if (vertex_array == 0) {
+		glDisableVertexAttribArray(POSITION_ATTRIB);
+		glDisableVertexAttribArray(TEXCOORD_ATTRIB);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		CHECK_GL_ERROR("glBindBuffer 0");
+	}
+
+	glUseProgram(0);
+	CHECK_GL_ERROR("glUseProgram 0");
+
+	return true;
+}
+
+// Render the YUV video frame. Planar format takes a second pass for the half resolution chroma planes.
+// Leaves the FBO bound for reading.
+bool ScreenRecorder::draw_yuv_frame(char *error_message) {
+	int width = *capture_params.width;
+	int height = *capture_params.height;
+
+	#ifndef DM_PLATFORM_HTML5
+		if (gpu_format == GPU_FORMAT_PLANAR) {
+			glBindFramebuffer(GL_FRAMEBUFFER, chroma_fbo);
+			CHECK_GL_ERROR("glBindFramebuffer chroma_fbo");
+			glViewport(0, 0, width / 2, height / 2);
+			CHECK_GL_ERROR("glViewport chroma");
+			if (!draw_quad(&chroma_program, capture_params.texture_id, error_message)) {
+				return false;
+			}
+		}
+	#endif
+
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	CHECK_GL_ERROR("glBindFramebuffer fbo");
+
+	if (gpu_format == GPU_FORMAT_RGBA) {
+		glViewport(0, 0, width / 4, height * 3 / 2);
+	} else {
+		glViewport(0, 0, width, height);
+	}
+	CHECK_GL_ERROR("glViewport");
+
+	if (!draw_quad(&yuv_program, capture_params.texture_id, error_message)) {
 		return false;
 	}
+	#ifndef DM_PLATFORM_HTML5
+		if (is_active_map && !draw_active_map(error_message)) {
+			return false;
+		}
+	#endif
+	return true;
+}
+
+#ifndef DM_PLATFORM_HTML5
+	// Compare the Y, U and V planes with the previous ones into the macroblock mask, then keep them as the previous
+	// planes. The copies stay on the GPU, only the mask is read back. Leaves the FBO bound for reading.
+	bool ScreenRecorder::draw_active_map(char *error_message) {
+		int width = *capture_params.width;
+		int height = *capture_params.height;
+		glBindFramebuffer(GL_FRAMEBUFFER, active_map_fbo);
+		CHECK_GL_ERROR("glBindFramebuffer active_map_fbo");
+		glViewport(0, 0, active_map_cols, active_map_rows);
+		CHECK_GL_ERROR("glViewport active map");
+		GLuint textures[3] = {previous_planes_texture, u_texture, v_texture};
+		for (int i = 0; i < 3; ++i) {
+			glActiveTexture(GL_TEXTURE1 + i);
+			glBindTexture(GL_TEXTURE_2D, textures[i]);
+			CHECK_GL_ERROR("glBindTexture active map planes");
+		}
+		if (!draw_quad(&active_map_program, scaled_texture, error_message)) {
+			return false;
+		}
+
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, previous_planes_texture);
+		CHECK_GL_ERROR("glBindTexture previous_planes_texture");
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		CHECK_GL_ERROR("glBindFramebuffer fbo");
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+		CHECK_GL_ERROR("glCopyTexSubImage2D previous Y plane");
+		glBindFramebuffer(GL_FRAMEBUFFER, chroma_fbo);
+		CHECK_GL_ERROR("glBindFramebuffer chroma_fbo");
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, height, 0, 0, width / 2, height / 2);
+		glReadBuffer(GL_COLOR_ATTACHMENT1);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, width / 2, height, 0, 0, width / 2, height / 2);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		CHECK_GL_ERROR("glCopyTexSubImage2D previous chroma planes");
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		CHECK_GL_ERROR("glBindFramebuffer fbo");
+
+		// Texture units 1 to 3 are not used by the capture otherwise.
+		for (int i = 3; i >= 1; --i) {
+			glActiveTexture(GL_TEXTURE0 + i);
+			glBindTexture(GL_TEXTURE_2D, 0);
+		}
+		glActiveTexture(GL_TEXTURE0);
+		CHECK_GL_ERROR("glActiveTexture 0");
+		return true;
+	}
+#endif
+
+// Capture the render target as YUV video frame and pass it into the video encoder. Color conversion is done either
+// on the GPU with the YUV shader or on the CPU from the render target's pixels.
+bool ScreenRecorder::capture_frame(char *error_message) {
+	if (!is_frame_due()) {
+		++stats.decimated_frames;
+		return true;
+	}
+	uint64_t start_time = utils::get_time();
+	int64_t timestamp = get_timestamp();
+	int frame_conversion = get_frame_conversion();
+	#ifndef DM_PLATFORM_HTML5
+		// Collect finished readbacks first, so their buffers can take this frame.
+		uint64_t submit_time = 0;
+		int read_conversion = -1;
+		while (pbo_pending > 0 && is_pixel_buffer_ready((pbo_head + pbo_count - pbo_pending) % pbo_count)) {
+			int index = (pbo_head + pbo_count - pbo_pending) % pbo_count;
+			uint8_t *data = NULL;
+			uint64_t readback_start_time = utils::get_time();
+			if (!read_pixel_buffer(index, &data, error_message)) {
+				return false;
+			}
+			stats.readback_time += utils::get_time() - readback_start_time;
+			if (data != NULL) {
+				read_conversion = pbo_conversion[index];
+				uint64_t submit_start_time = utils::get_time();
+				submit_frame(data, pbo_timestamps[index]);
+				submit_time += utils::get_time() - submit_start_time;
+			}
+		}
+		if (pbo_pending == pbo_count) {
+			// The GPU is behind, skip the frame instead of waiting for it.
+			++stats.not_ready_frames;
+			return true;
+		}
+	#endif
+	if (frame_conversion == CONVERSION_GPU) {
+		if (!draw_yuv_frame(error_message)) {
+			return false;
+		}
+	} else {
+		glBindFramebuffer(GL_FRAMEBUFFER, source_fbo);
+		CHECK_GL_ERROR("glBindFramebuffer source_fbo");
+	}
+
 	#ifdef DM_PLATFORM_HTML5
-		delete []pixels;
+		uint64_t readback_start_time = utils::get_time();
+		read_yuv_frame(pixels);
+		CHECK_GL_ERROR("glReadPixels");
+		add_readback_time(utils::get_time() - readback_start_time);
+		add_conversion_time(frame_conversion, utils::get_time() - start_time);
+		submit_frame(pixels, timestamp);
+	#else
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[pbo_head]);
+		CHECK_GL_ERROR("glBindBuffer GL_PIXEL_PACK_BUFFER");
+
+		uint64_t readback_start_time = utils::get_time();
+		if (frame_conversion == CONVERSION_GPU) {
+			read_yuv_frame(0);
+		} else {
+			// BGRA is the native readback format on most desktop drivers.
+			glPixelStorei(GL_PACK_ALIGNMENT, 4);
+			glReadPixels(0, 0, source_texture_width, source_texture_height, GL_BGRA, GL_UNSIGNED_BYTE, 0);
+		}
+		CHECK_GL_ERROR("glReadPixels");
+		add_readback_time(utils::get_time() - readback_start_time);
+		pbo_conversion[pbo_head] = frame_conversion;
+		pbo_timestamps[pbo_head] = timestamp;
+		// The mask is valid if the previous planes came from the frame before, CPU frames break the sequence.
+		if (is_active_map && frame_conversion == CONVERSION_GPU) {
+			pbo_active_map_ids[pbo_head] = ++active_map_id;
+			pbo_active_map_valid[pbo_head] = is_previous_planes_valid;
+			is_previous_planes_valid = true;
+		} else {
+			pbo_active_map_ids[pbo_head] = 0;
+			pbo_active_map_valid[pbo_head] = false;
+			is_previous_planes_valid = false;
+		}
+		if (is_fence_available) {
+			pbo_fences[pbo_head] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			if (pbo_fences[pbo_head] == 0) {
+				dmLogInfo("Fence sync is not available, readback buffers are mapped when the ring is full.");
+				pbo_fences[pbo_head] = 0;
+				is_fence_available = false;
+			}
+		}
+		pbo_head = (pbo_head + 1) % pbo_count;
+		++pbo_pending;
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		CHECK_GL_ERROR("glBindBuffer GL_PIXEL_PACK_BUFFER 0");
+	#endif
+
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	CHECK_GL_ERROR("glBindFramebuffer 0");
+
+	#ifndef DM_PLATFORM_HTML5
+		// Frames of the other backend are not counted while calibrating.
+		if (read_conversion == frame_conversion) {
+			add_conversion_time(frame_conversion, utils::get_time() - start_time - submit_time);
+		}
 	#endif
+	return check_frame_gl_error(error_message);
+}
+
+// Frame validation reads the GL error flag once per captured frame. The flag can't tell which call failed, so after
+// an error the next frame is checked after every call to report the failing stage.
+bool ScreenRecorder::check_frame_gl_error(char *error_message) {
+	if (gl_validation == GL_VALIDATION_FRAME) {
+		GLenum error = glGetError();
+		if (error) {
+			ERROR_MESSAGE("GL error %#04X while capturing the frame, the next frame is checked per call.", error);
+			gl_validation = GL_VALIDATION_VERBOSE;
+			is_gl_recheck = true;
+			return false;
+		}
+	} else if (is_gl_recheck) {
+		// The recheck frame passed, the error was not caused by the capture.
+		is_gl_recheck = false;
+		gl_validation = GL_VALIDATION_FRAME;
+	}
+	return true;
+}
+
+#ifndef DM_PLATFORM_HTML5
+	// Whether the GPU has finished writing the buffer. Without fences the oldest buffer is used once the ring is full.
+	bool ScreenRecorder::is_pixel_buffer_ready(int index) {
+		if (pbo_fences[index] == 0) {
+			return pbo_pending == pbo_count;
+		}
+		GLenum result = glClientWaitSync(pbo_fences[index], GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		return result != GL_TIMEOUT_EXPIRED;
+	}
+
+	// Copy the frame out of the buffer, or convert it on the CPU, and unmap it right away, so the PBO does not wait for
+	// the encoder. Persistently mapped buffers are read in place. Data is NULL if the encode queue drops the frame.
+	bool ScreenRecorder::read_pixel_buffer(int index, uint8_t **data, char *error_message) {
+		bool has_fence = pbo_fences[index] != 0;
+		if (has_fence) {
+			glDeleteSync(pbo_fences[index]);
+			pbo_fences[index] = 0;
+		}
+		--pbo_pending;
+		*data = NULL;
+		GLubyte *pixels = pbo_pointers[index];
+		if (pixels != NULL) {
+			// Persistently mapped buffer, without a fence only a full finish guarantees the data has arrived.
+			if (!has_fence) {
+				glFinish();
+			}
+			*data = acquire_frame();
+			copy_pixel_buffer(index, pixels, *data);
+			return true;
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, pbo[index]);
+		CHECK_GL_ERROR("glBindBuffer GL_PIXEL_PACK_BUFFER");
+		pixels = (GLubyte *)glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+		CHECK_GL_ERROR("glMapBuffer");
+		if (pixels) {
+			*data = acquire_frame();
+			copy_pixel_buffer(index, pixels, *data);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			CHECK_GL_ERROR("glUnmapBuffer GL_PIXEL_PACK_BUFFER");
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		return true;
+	}
+
+	// Data is NULL if the encode queue drops the frame.
+	void ScreenRecorder::copy_pixel_buffer(int index, const uint8_t *pixels, uint8_t *data) {
+		if (data == NULL) {
+			return;
+		}
+		int frame_size = *capture_params.width * *capture_params.height * 3 / 2;
+		if (pbo_conversion[index] == CONVERSION_GPU) {
+			FramePool::stream_copy(data, pixels, frame_size + get_active_map_size());
+		} else {
+			// Rows are read bottom-up.
+			int stride = 4 * source_texture_width;
+			RawFrame frame = {pixels + (source_texture_height - 1) * stride, source_texture_width, source_texture_height, -stride, PIXEL_FORMAT_BGRA};
+			convert_frame(&texture_yuv_converter, &frame, data);
+		}
+		if (is_active_map) {
+			uint8_t *trailer = data + frame_size + get_active_map_size();
+			memcpy(trailer, &pbo_active_map_ids[index], sizeof(uint32_t));
+			trailer[sizeof(uint32_t)] = pbo_active_map_valid[index];
+		}
+	}
+#endif
+
+// Convert a frame from CPU memory and pass it into the video encoder. The frame is read in place, without copying.
+bool ScreenRecorder::capture_raw_frame(const RawFrame *frame, char *error_message) {
+	if (frame->pixels == NULL) {
+		ERROR_MESSAGE("Frame has no pixel data.");
+		return false;
+	}
+	if (frame->width != *capture_params.source_width || frame->height != *capture_params.source_height) {
+		ERROR_MESSAGE("Frame size %dx%d does not match source size %dx%d.", frame->width, frame->height, *capture_params.source_width, *capture_params.source_height);
+		return false;
+	}
+	if (frame->stride > -4 * frame->width && frame->stride < 4 * frame->width) {
+		ERROR_MESSAGE("Frame stride %d is too small for width %d.", frame->stride, frame->width);
+		return false;
+	}
+	if (!is_frame_due()) {
+		++stats.decimated_frames;
+		return true;
+	}
+	int64_t timestamp = get_timestamp();
+	uint8_t *data = acquire_frame();
+	if (data == NULL) {
+		return true;
+	}
+	uint64_t start_time = utils::get_time();
+	convert_frame(&yuv_converter, frame, data);
+	add_conversion_time(CONVERSION_CPU, utils::get_time() - start_time);
+	submit_frame(data, timestamp);
+	return true;
+}
+
+// Backend for the next captured frame. In auto mode both backends are timed on the first frames and the faster one is kept.
+int ScreenRecorder::get_frame_conversion() {
+	if (conversion != CONVERSION_AUTO) {
+		return conversion;
+	}
+	if (calibration_frame < CALIBRATION_FRAMES) {
+		++calibration_frame;
+		return calibration_frame <= CALIBRATION_FRAMES / 2 ? CONVERSION_GPU : CONVERSION_CPU;
+	}
+	double gpu_time = stats.gpu_conversion_frames > 0 ? (double)stats.gpu_conversion_time / stats.gpu_conversion_frames : 0.0;
+	double cpu_time = stats.cpu_conversion_frames > 0 ? (double)stats.cpu_conversion_time / stats.cpu_conversion_frames : 0.0;
+	conversion = cpu_time > 0.0 && cpu_time < gpu_time ? CONVERSION_CPU : CONVERSION_GPU;
+	stats.conversion = conversion;
+	dmLogInfo("Color conversion: GPU %.3f ms, CPU (%s) %.3f ms per frame, using %s.", gpu_time / 1000.0, stats.cpu_kernel, cpu_time / 1000.0, conversion == CONVERSION_CPU ? "CPU" : "GPU");
+	return conversion;
+}
+
+// Read the YUV frame rendered by draw_yuv_frame() into memory or into the bound pixel buffer.
+// RGBA rows are whole words, so the driver can copy them without repacking. Data is an offset into the pixel buffer.
+void ScreenRecorder::read_yuv_frame(uint8_t *data) {
+	int w = *capture_params.width;
+	int h = *capture_params.height;
+	if (gpu_format == GPU_FORMAT_RGBA) {
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		glReadPixels(0, 0, w / 4, h * 3 / 2, GL_RGBA, GL_UNSIGNED_BYTE, data);
+	#ifndef DM_PLATFORM_HTML5
+	} else if (gpu_format == GPU_FORMAT_PLANAR) {
+		// Planes are tightly packed one after another, as the encoder expects them.
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(0, 0, w, h, GL_RED, GL_UNSIGNED_BYTE, data);
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, chroma_fbo);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		glReadPixels(0, 0, w / 2, h / 2, GL_RED, GL_UNSIGNED_BYTE, data + w * h);
+		glReadBuffer(GL_COLOR_ATTACHMENT1);
+		glReadPixels(0, 0, w / 2, h / 2, GL_RED, GL_UNSIGNED_BYTE, data + w * h * 5 / 4);
+		glReadBuffer(GL_COLOR_ATTACHMENT0);
+		// Macroblock mask follows the planes.
+		if (is_active_map) {
+			glBindFramebuffer(GL_READ_FRAMEBUFFER, active_map_fbo);
+			glReadPixels(0, 0, active_map_cols, active_map_rows, GL_RED, GL_UNSIGNED_BYTE, data + w * h * 3 / 2);
+		}
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	#endif
+	} else {
+		glReadPixels(0, 0, w, h / 2, GL_RGB, GL_UNSIGNED_BYTE, data);
+	}
+}
+
+void ScreenRecorder::add_readback_time(uint64_t time) {
+	stats.readback_time += time;
+	++stats.readback_frames;
+}
+
+void ScreenRecorder::add_conversion_time(int frame_conversion, uint64_t time) {
+	if (frame_conversion == CONVERSION_GPU) {
+		stats.gpu_conversion_time += time;
+		++stats.gpu_conversion_frames;
+	} else {
+		stats.cpu_conversion_time += time;
+		++stats.cpu_conversion_frames;
+	}
+}
+
+// Size of the macroblock mask carried by each frame, 0 without the active map.
+int ScreenRecorder::get_active_map_size() {
+	return is_active_map ? active_map_cols * active_map_rows : 0;
+}
+
+// Size of a frame in the frame pool: I420 planes, followed by the macroblock mask and its trailer.
+int ScreenRecorder::get_frame_size() {
+	int size = *capture_params.width * *capture_params.height * 3 / 2;
+	if (is_active_map) {
+		size += get_active_map_size() + ACTIVE_MAP_TRAILER_SIZE;
+	}
+	return size;
+}
+
+// Point the encoder image into a contiguous I420 buffer.
+void ScreenRecorder::set_image_planes(uint8_t *data) {
+	int w = *capture_params.width;
+	int h = *capture_params.height;
+	image.planes[0] = data; // Y frame.
+	image.planes[1] = image.planes[0] + w * h; // U frame.
+	image.planes[2] = image.planes[1] + w * h / 4; // V frame.
+}
+
+void ScreenRecorder::convert_frame(YuvConverter *converter, const RawFrame *frame, uint8_t *data) {
+	int w = *capture_params.width;
+	int h = *capture_params.height;
+	uint8_t *u_plane = data + w * h;
+	converter->convert(frame, data, u_plane, u_plane + w * h / 4);
+}
+
+// Buffer for the next I420 frame. With asynchronous encoding it comes from the encode queue and is NULL if the queue
+// drops the frame.
+uint8_t *ScreenRecorder::acquire_frame() {
+	if (!*capture_params.async_encoding) {
+		return image.img_data;
+	}
+	return encode_queue.acquire();
+}
+
+// Presentation time of a frame captured now, in milliseconds. Variable frame rate takes it from the monotonic clock,
+// so frames the game does not deliver leave a gap instead of speeding the video up. Constant frame rate spaces
+// captured frames by 1 / fps, which suits frames rendered slower than real time. Every frame counts, even the ones
+// that are dropped later. Timestamps strictly increase, as the encoder and the muxer expect.
+int64_t ScreenRecorder::get_timestamp() {
+	uint64_t time = utils::get_time();
+	if (frame_count == 0) {
+		first_frame_time = time;
+	}
+	// Keep the decimation cadence, but don't catch up with frames missed during a stall.
+	if (frame_count == 0 || time > next_frame_time + frame_interval) {
+		next_frame_time = time;
+	}
+	next_frame_time += frame_interval;
+	int64_t timestamp;
+	if (*capture_params.variable_frame_rate) {
+		timestamp = (time - first_frame_time) / 1000;
+	} else {
+		timestamp = (int64_t)frame_count * 1000 / *capture_params.fps;
+	}
+	++frame_count;
+	if (timestamp <= last_timestamp) {
+		timestamp = last_timestamp + 1;
+	}
+	last_timestamp = timestamp;
+	return timestamp;
+}
+
+// Whether a frame arriving now would be captured. Frames are captured at fps at most, the rest are skipped before any
+// work is done, in both frame rate modes. A quarter of the interval is tolerated, so render frames that jitter around
+// the capture interval don't get skipped. Frames rendered slower than fps are all captured.
+bool ScreenRecorder::is_frame_due() {
+	if (frame_count == 0) {
+		return true;
+	}
+	return utils::get_time() + frame_interval / 4 >= next_frame_time;
+}
+
+void ScreenRecorder::submit_frame(uint8_t *data, int64_t timestamp) {
+	if (*capture_params.async_encoding) {
+		encode_queue.push(timestamp);
+	} else {
+		set_image_planes(data);
+		encode_frame(timestamp, false);
+	}
+}
+
+// Encode the next frame from the encode queue. Returns false once the queue is closed and drained.
+bool ScreenRecorder::encode_queued_frame() {
+	int64_t timestamp = 0;
+	uint8_t *data = encode_queue.pop(&timestamp);
+	if (data == NULL) {
+		return false;
+	}
+	set_image_planes(data);
+	encode_frame(timestamp, false);
+	encode_queue.finish();
+	return true;
+}
+
+Stats *ScreenRecorder::get_stats() {
+	stats.static_frames = thread_atomic_int_load(&static_frames);
+	stats.layer_dropped_frames = thread_atomic_int_load(&layer_dropped_frames);
+	stats.replay_memory = (uint64_t)thread_atomic_int_load(&replay_memory) * 1024;
+	stats.replay_peak_memory = (uint64_t)thread_atomic_int_load(&replay_peak_memory) * 1024;
+	stats.encoder_speed = thread_atomic_int_load(&encoder_speed);
+	stats.encode_time = thread_atomic_int_load(&encode_time);
+	for (int i = 0; i < ENCODE_TIME_BUCKETS; ++i) {
+		stats.encode_time_histogram[i] = thread_atomic_int_load(&encode_time_histogram[i]);
+	}
+	get_encoder_size(thread_atomic_int_load(&encoder_scale), &stats.encoder_width, &stats.encoder_height);
+	thread_mutex_lock(&resolution_changes_mutex);
+	stats.total_resolution_changes = resolution_change_count;
+	stats.resolution_change_count = resolution_change_count < MAX_RESOLUTION_CHANGES ? resolution_change_count : MAX_RESOLUTION_CHANGES;
+	for (int i = 0; i < stats.resolution_change_count; ++i) {
+		int index = (resolution_change_count - stats.resolution_change_count + i) % MAX_RESOLUTION_CHANGES;
+		stats.resolution_changes[i] = resolution_changes[index];
+	}
+	thread_mutex_unlock(&resolution_changes_mutex);
+	if (*capture_params.async_encoding) {
+		stats.queue_depth = encode_queue.get_depth();
+		stats.queue_max_depth = encode_queue.get_max_depth();
+		stats.dropped_frames = encode_queue.get_dropped_frames();
+	}
+	return &stats;
+}
+
+bool ScreenRecorder::stop(char *error_message) {
+	if (encoding_thread != NULL) {
+		dmLogDebug("Finishing encoding thread.");
+		// Finish encoding thread, queued frames are encoded first.
+		encode_queue.close();
+		thread_join(encoding_thread);
+		thread_destroy(encoding_thread);
+		dmLogDebug("Finished encoding thread.");
+		encoding_thread = NULL;
+	}
+	// Flush encoder. It is kept for the next recording.
+	while (encode_frame(-1, true)) {
+	}
 	if (circular_buffer != NULL) {
-		int64_t first_timestamp = 0;
-		bool got_keyframe = false;
 		uint8_t *data = NULL;
 		size_t size = 0;
 		int64_t timestamp = 0;
 		bool is_keyframe = false;
 		uint32_t frame_index = 0;
-		while (circular_buffer->get_frame(&data, &size, &timestamp, &is_keyframe, &frame_index)) {
-			if (!got_keyframe && is_keyframe) {
-				got_keyframe = true;
-				first_timestamp = timestamp; // Timestamps must start from 0.
-			}
-			// Must wait for a keyframe first.
-			if (got_keyframe) {
+		// The time window ends with the last captured frame, which may be a static frame after the newest stored one.
+		// The clip starts with the keyframe the window starts in.
+		if (circular_buffer->find_keyframe(circular_buffer->get_window_start(last_timestamp), &frame_index)) {
+			int64_t first_timestamp = 0;
+			int64_t last_frame_timestamp = 0;
+			bool is_first = true;
+			while (circular_buffer->get_frame(&data, &size, &timestamp, &is_keyframe, &frame_index)) {
+				if (is_first) {
+					is_first = false;
+					first_timestamp = timestamp; // Timestamps must start from 0.
+				}
+				last_frame_timestamp = timestamp;
 				if (!webm_writer.write_frame(data, size, timestamp - first_timestamp, is_keyframe)) {
 					ERROR_MESSAGE("Failed to write compressed frame %d.", frame_index);
 					return false;
 				}
 			}
+			if (static_end_timestamp > last_frame_timestamp) {
+				webm_writer.extend_last_frame(static_end_timestamp - first_timestamp);
+			}
 		}
 		delete circular_buffer;
 		circular_buffer = NULL;
@@ -645,27 +2067,357 @@ bool ScreenRecorder::stop(char *error_message) {
 	return true;
 }
 
-bool ScreenRecorder::encode_frame(bool is_flush) {
+// Whether the frame in the encoder image is identical to the previous one. Such frames are not encoded, the previous
+// frame lasts longer instead.
+bool ScreenRecorder::is_static_frame() {
+	if (!*capture_params.skip_static_frames) {
+		return false;
+	}
+	uint64_t hash = FramePool::hash(image.planes[0], *capture_params.width * *capture_params.height * 3 / 2);
+	bool is_static = has_frame_hash && hash == frame_hash;
+	frame_hash = hash;
+	has_frame_hash = true;
+	return is_static;
+}
+
+// Whether frames pile up in the encode queue, the encoding thread then drops enhancement layer frames.
+bool ScreenRecorder::is_encoder_behind() {
+	return *capture_params.async_encoding && 2 * encode_queue.get_depth() >= (uint32_t)*capture_params.queue_size;
+}
+
+// Pass the macroblock mask of the frame in the encoder image to the encoder, unchanged macroblocks are skipped and
+// copied from the reference frame. The mask is only used if it is relative to the last frame the encoder has coded,
+// otherwise every macroblock is encoded. Returns the frame's mask sequence number, 0 if it has none.
+uint32_t ScreenRecorder::set_active_map() {
+	if (!is_active_map) {
+		return 0;
+	}
+	uint8_t *map = image.planes[0] + *capture_params.width * *capture_params.height * 3 / 2;
+	uint8_t *trailer = map + get_active_map_size();
+	uint32_t id;
+	memcpy(&id, trailer, sizeof(uint32_t));
+	bool is_valid = trailer[sizeof(uint32_t)] && id == encoded_active_map_id + 1;
+	#ifndef DM_RELEASE
+		// A mask is only relative to the encoder's reference if the previous frame updated it.
+		if (is_valid && !is_last_frame_reference) {
+			dmLogError("Active map %u is not relative to the encoder's reference frame, encoding every macroblock.", id);
+			is_valid = false;
+		}
+	#endif
+	int cols = active_map_cols;
+	int rows = active_map_rows;
+	int scale = thread_atomic_int_load(&encoder_scale);
+	if (scale != VP8E_NORMAL) {
+		// A scaled macroblock is active if any of the frame's macroblocks it covers is.
+		int width, height;
+		get_encoder_size(scale, &width, &height);
+		cols = (width + 15) / 16;
+		rows = (height + 15) / 16;
+		if (is_valid) {
+			int num = SCALE_RATIOS[scale][0];
+			int den = SCALE_RATIOS[scale][1];
+			for (int row = 0; row < rows; ++row) {
+				int first_row = row * den / num;
+				int last_row = ((row + 1) * den - 1) / num;
+				if (last_row >= active_map_rows) {
+					last_row = active_map_rows - 1;
+				}
+				for (int col = 0; col < cols; ++col) {
+					int first_col = col * den / num;
+					int last_col = ((col + 1) * den - 1) / num;
+					if (last_col >= active_map_cols) {
+						last_col = active_map_cols - 1;
+					}
+					uint8_t is_active = 0;
+					for (int r = first_row; r <= last_row && !is_active; ++r) {
+						for (int c = first_col; c <= last_col && !is_active; ++c) {
+							is_active = map[r * active_map_cols + c];
+						}
+					}
+					scaled_active_map[row * cols + col] = is_active;
+				}
+			}
+			map = scaled_active_map;
+		}
+	}
+	vpx_active_map_t active_map = {is_valid ? map : NULL, (unsigned int)rows, (unsigned int)cols};
+	if (vpx_codec_control(&codec, VP8E_SET_ACTIVEMAP, &active_map)) {
+		dmLogError("Failed to set active map: %s", vpx_codec_error(&codec));
+	}
+	return id;
+}
+
+// Replace the quality regions, they are applied from the next encoded frame. Can be called while recording.
+bool ScreenRecorder::set_regions(const QualityRegion *new_regions, int count, char *error_message) {
+	if (count > MAX_REGIONS) {
+		ERROR_MESSAGE("Too many regions, at most %d are supported.", MAX_REGIONS);
+		return false;
+	}
+	// VP8 has four segments, the first one is left for the rest of the frame.
+	int qualities[MAX_REGIONS];
+	int quality_count = 0;
+	for (int i = 0; i < count; ++i) {
+		const QualityRegion *region = &new_regions[i];
+		if (region->width <= 0 || region->height <= 0) {
+			ERROR_MESSAGE("Region %d has invalid size %dx%d.", i + 1, region->width, region->height);
+			return false;
+		}
+		if (region->quality < -63 || region->quality > 63) {
+			ERROR_MESSAGE("Region %d has invalid quality %d, must be from -63 to 63.", i + 1, region->quality);
+			return false;
+		}
+		bool is_new = region->quality != 0;
+		for (int j = 0; j < quality_count && is_new; ++j) {
+			is_new = qualities[j] != region->quality;
+		}
+		if (is_new) {
+			qualities[quality_count++] = region->quality;
+		}
+	}
+	if (quality_count > 3) {
+		ERROR_MESSAGE("Regions have %d different qualities, at most 3 are supported.", quality_count);
+		return false;
+	}
+	thread_mutex_lock(&regions_mutex);
+	memcpy(regions, new_regions, count * sizeof(QualityRegion));
+	region_count = count;
+	thread_mutex_unlock(&regions_mutex);
+	thread_atomic_int_store(&is_roi_map_changed, 1);
+	return true;
+}
+
+// Pass the quality regions to the encoder as a map of macroblock segments. Each distinct quality takes a segment,
+// macroblocks touched by a region belong to it and later regions overlap earlier ones. Without regions the map is
+// removed.
+void ScreenRecorder::set_roi_map() {
+	QualityRegion current_regions[MAX_REGIONS];
+	thread_mutex_lock(&regions_mutex);
+	int count = region_count;
+	memcpy(current_regions, regions, count * sizeof(QualityRegion));
+	thread_mutex_unlock(&regions_mutex);
+
+	// Regions are in pixels of the frame, the map is in macroblocks of the encoder's internal resolution.
+	int scale = thread_atomic_int_load(&encoder_scale);
+	int num = SCALE_RATIOS[scale][0];
+	int den = SCALE_RATIOS[scale][1];
+	int width, height;
+	get_encoder_size(scale, &width, &height);
+	int cols = (width + 15) / 16;
+	int rows = (height + 15) / 16;
+	memset(roi_map, 0, rows * cols);
+	vpx_roi_map_t roi = {};
+	roi.rows = rows;
+	roi.cols = cols;
+	int segment_count = 1;
+	for (int i = 0; i < count; ++i) {
+		const QualityRegion *region = &current_regions[i];
+		// Quality is inverse to the quantizer.
+		int delta_q = -region->quality;
+		int segment = 0;
+		if (delta_q != 0) {
+			for (segment = 1; segment < segment_count && roi.delta_q[segment] != delta_q; ++segment) {
+			}
+			if (segment == segment_count) {
+				roi.delta_q[segment_count++] = delta_q;
+			}
+		}
+		int first_col = region->x < 0 ? 0 : region->x * num / den / 16;
+		int first_row = region->y < 0 ? 0 : region->y * num / den / 16;
+		int last_col = ((region->x + region->width) * num - 1) / den / 16;
+		int last_row = ((region->y + region->height) * num - 1) / den / 16;
+		for (int row = first_row; row <= last_row && row < rows; ++row) {
+			for (int col = first_col; col <= last_col && col < cols; ++col) {
+				roi_map[row * cols + col] = segment;
+			}
+		}
+	}
+	roi.roi_map = segment_count > 1 ? roi_map : NULL;
+	if (vpx_codec_control(&codec, VP8E_SET_ROI_MAP, &roi)) {
+		dmLogError("Failed to set ROI map: %s", vpx_codec_error(&codec));
+	}
+}
+
+// Internal resolution of the encoder with the given VPX_SCALING mode, rounded up like libvpx does.
+void ScreenRecorder::get_encoder_size(int scale, int *width, int *height) {
+	int num = SCALE_RATIOS[scale][0];
+	int den = SCALE_RATIOS[scale][1];
+	*width = (*capture_params.width * num + den - 1) / den;
+	*height = (*capture_params.height * num + den - 1) / den;
+}
+
+bool ScreenRecorder::set_encoder_speed(int speed) {
+	// Negative values set the speed directly, 0 and positive ones let libvpx adjust it to the deadline, so the speed
+	// is never below 1.
+	if (vpx_codec_control(&codec, VP8E_SET_CPUUSED, -speed)) {
+		dmLogError("Failed to set encoder speed: %s", vpx_codec_error(&codec));
+		return false;
+	}
+	thread_atomic_int_store(&encoder_speed, speed);
+	adjustment_frames = 0;
+	return true;
+}
+
+// Change the internal resolution of the encoder. Frames are still captured and stored at the full size, the encoder
+// downscales them and the decoder scales them back up. The next frame is a keyframe.
+bool ScreenRecorder::set_encoder_scale(int scale, int64_t timestamp) {
+	vpx_scaling_mode_t mode = {(VPX_SCALING_MODE)scale, (VPX_SCALING_MODE)scale};
+	if (vpx_codec_control(&codec, VP8E_SET_SCALEMODE, &mode)) {
+		dmLogError("Failed to set encoder scale: %s", vpx_codec_error(&codec));
+		return false;
+	}
+	// Setting the unchanged configuration makes the encoder resize right away instead of at the next keyframe.
+	if (vpx_codec_enc_config_set(&codec, &encoder_config)) {
+		dmLogError("Failed to reconfigure encoder: %s", vpx_codec_error(&codec));
+		return false;
+	}
+	thread_atomic_int_store(&encoder_scale, scale);
+	adjustment_frames = 0;
+	// The macroblock grid has changed.
+	set_roi_map();
+
+	int width, height;
+	get_encoder_size(scale, &width, &height);
+	dmLogInfo("Encoder resolution changed to %dx%d at %lld ms.", width, height, (long long)timestamp);
+	thread_mutex_lock(&resolution_changes_mutex);
+	ResolutionChange *change = &resolution_changes[resolution_change_count % MAX_RESOLUTION_CHANGES];
+	change->timestamp = timestamp;
+	change->width = width;
+	change->height = height;
+	++resolution_change_count;
+	thread_mutex_unlock(&resolution_changes_mutex);
+	return true;
+}
+
+// Keep the average encode time under the budget. The encoder gets faster and coarser when it is over the budget or
+// the encode queue is full, and slower and finer when it takes less than half of the budget. When the fastest speed
+// is not enough, the internal resolution is lowered. It is raised again before the speed is lowered, once the encode
+// time estimated for the higher resolution fits the budget. Everything changes one step at a time.
+void ScreenRecorder::update_encoder_load(uint64_t time, int64_t timestamp) {
+	int bucket = 0;
+	for (uint64_t bound = 1000; time >= bound && bucket < ENCODE_TIME_BUCKETS - 1; bound *= 2) {
+		++bucket;
+	}
+	thread_atomic_int_inc(&encode_time_histogram[bucket]);
+
+	average_encode_time = average_encode_time == 0 ? time : (7 * average_encode_time + time) / 8;
+	thread_atomic_int_store(&encode_time, (int)average_encode_time);
+	if (++adjustment_frames < SPEED_ADJUSTMENT_FRAMES) {
+		return;
+	}
+	uint64_t budget = *capture_params.encode_budget * 1000.0;
+	int speed = thread_atomic_int_load(&encoder_speed);
+	int scale = thread_atomic_int_load(&encoder_scale);
+	bool is_queue_full = *capture_params.async_encoding && encode_queue.get_depth() >= (uint32_t)*capture_params.queue_size;
+	bool is_scale_due = adjustment_frames >= SCALE_ADJUSTMENT_FRAMES;
+	if (average_encode_time > budget || is_queue_full) {
+		if (speed < MAX_ENCODER_SPEED) {
+			set_encoder_speed(speed + 1);
+		} else if (scale < MAX_ENCODER_SCALE && is_scale_due) {
+			set_encoder_scale(scale + 1, timestamp);
+		}
+	} else if (average_encode_time < budget / 2) {
+		if (scale > VP8E_NORMAL) {
+			// Encode time is taken as proportional to the number of pixels, the estimate has to stay under 3/4 of
+			// the budget.
+			uint64_t larger = SCALE_RATIOS[scale - 1][0] * SCALE_RATIOS[scale][1];
+			uint64_t current = SCALE_RATIOS[scale - 1][1] * SCALE_RATIOS[scale][0];
+			if (is_scale_due && 4 * average_encode_time * larger * larger < 3 * budget * current * current) {
+				set_encoder_scale(scale - 1, timestamp);
+			}
+		} else if (speed > *capture_params.min_encoder_speed) {
+			set_encoder_speed(speed - 1);
+		}
+	}
+}
+
+bool ScreenRecorder::encode_frame(int64_t timestamp, bool is_flush) {
+	if (!is_flush && is_static_frame()) {
+		// Same content as the reference frame, the mask sequence continues.
+		if (is_active_map) {
+			memcpy(&encoded_active_map_id, image.planes[0] + *capture_params.width * *capture_params.height * 3 / 2 + get_active_map_size(), sizeof(uint32_t));
+		}
+		thread_atomic_int_inc(&static_frames);
+		if (circular_buffer != NULL) {
+			static_end_timestamp = timestamp;
+		} else {
+			webm_writer.extend_last_frame(timestamp);
+		}
+		return true;
+	}
+	vpx_enc_frame_flags_t flags = 0;
+	if (!is_flush && is_keyframe_forced) {
+		flags |= VPX_EFLAG_FORCE_KF;
+		is_keyframe_forced = false;
+	}
+	// Whether the frame becomes the encoder's last frame reference, masks and hashes chain only from such frames.
+	bool is_reference = true;
+	if (!is_flush && *capture_params.temporal_layers) {
+		int layer = layer_frame_count++ % TEMPORAL_LAYERS;
+		if (layer > 0 && is_encoder_behind()) {
+			// Nothing references the frame, the previous one is shown longer instead. The next frame can't be
+			// skipped or masked against this one.
+			has_frame_hash = false;
+			is_last_frame_reference = false;
+			thread_atomic_int_inc(&layer_dropped_frames);
+			return true;
+		}
+		is_reference = layer == 0;
+		flags |= layer > 0 ? ENHANCEMENT_LAYER_FLAGS : BASE_LAYER_FLAGS;
+		if (vpx_codec_control(&codec, VP8E_SET_TEMPORAL_LAYER_ID, layer)) {
+			dmLogError("Failed to set temporal layer: %s", vpx_codec_error(&codec));
+		}
+	}
+	uint32_t frame_active_map_id = 0;
+	if (!is_flush) {
+		frame_active_map_id = set_active_map();
+		if (thread_atomic_int_swap(&is_roi_map_changed, 0)) {
+			set_roi_map();
+		}
+	}
 	bool has_packets = false;
+	bool has_frame = false;
 	vpx_codec_iter_t iter = NULL;
 	const vpx_codec_cx_pkt_t *pkt = NULL;
-	const vpx_codec_err_t res = vpx_codec_encode(&codec, is_flush ? NULL : &image, is_flush ? -1 : frame_count++, 1, 0, VPX_DL_REALTIME);
+	// Duration is nominal, the encoder measures the actual frame rate from timestamps.
+	uint64_t start_time = utils::get_time();
+	const vpx_codec_err_t res = vpx_codec_encode(&codec, is_flush ? NULL : &image, pts_offset + timestamp, 1000 / *capture_params.fps, flags, VPX_DL_REALTIME);
 	if (res != VPX_CODEC_OK) {
 		dmLogError("Failed to encode frame.");
 		return false;
 	}
+	if (!is_flush) {
+		update_encoder_load(utils::get_time() - start_time, timestamp);
+		next_pts_offset = pts_offset + timestamp + 1000 / *capture_params.fps;
+	}
 	while ((pkt = vpx_codec_get_cx_data(&codec, &iter)) != NULL) {
 		has_packets = true;
 		if (pkt->kind == VPX_CODEC_CX_FRAME_PKT) {
+			has_frame = true;
 			if (circular_buffer != NULL) {
-				if (!circular_buffer->add_frame(static_cast<uint8_t *>(pkt->data.frame.buf), pkt->data.frame.sz, pkt->data.frame.pts, pkt->data.frame.flags & VPX_FRAME_IS_KEY)) {
-					dmLogError("Failed to add compressed frame %d to the circular encoder.", frame_count);
+				if (!circular_buffer->add_frame(static_cast<uint8_t *>(pkt->data.frame.buf), pkt->data.frame.sz, pkt->data.frame.pts - pts_offset, pkt->data.frame.flags & VPX_FRAME_IS_KEY)) {
+					dmLogError("Failed to add compressed frame %lld to the circular encoder.", (long long)timestamp);
+				}
+				if (circular_buffer->needs_keyframe()) {
+					// The replay lost a frame, later frames are dropped until a keyframe restarts the GOP chain.
+					is_keyframe_forced = true;
 				}
-			} else if (!webm_writer.write_frame(static_cast<uint8_t *>(pkt->data.frame.buf), pkt->data.frame.sz, pkt->data.frame.pts, pkt->data.frame.flags & VPX_FRAME_IS_KEY)) {
-				dmLogError("Failed to write compressed frame %d.", frame_count);
+				thread_atomic_int_store(&replay_memory, circular_buffer->get_memory_size() / 1024);
+				thread_atomic_int_store(&replay_peak_memory, circular_buffer->get_peak_memory_size() / 1024);
+			} else if (!webm_writer.write_frame(static_cast<uint8_t *>(pkt->data.frame.buf), pkt->data.frame.sz, pkt->data.frame.pts - pts_offset, pkt->data.frame.flags & VPX_FRAME_IS_KEY)) {
+				dmLogError("Failed to write compressed frame %lld.", (long long)timestamp);
 			}
 		}
 	}
+	if (!is_flush) {
+		if (has_frame && is_reference) {
+			encoded_active_map_id = frame_active_map_id;
+		} else {
+			// Dropped by rate control or an enhancement layer frame, the encoder still references the frame before.
+			// The next frame can't be skipped or masked against this one.
+			has_frame_hash = false;
+		}
+		is_last_frame_reference = has_frame && is_reference;
+	}
 	return has_packets;
 }
 
@@ -39,6 +39,102 @@
 #include <dmsdk/dlib/log.h>
 #include "circular_buffer.h"
 #include "webmwriter.h"
+#include "yuv_converter.h"
+#include "encode_queue.h"
+
+// Color conversion backends.
+enum Conversion {
+	CONVERSION_AUTO,
+	CONVERSION_GPU,
+	CONVERSION_CPU,
+	CONVERSION_GPU_RGB,
+	CONVERSION_GPU_RGBA
+};
+
+// Layout of the YUV frame rendered by the GPU conversion.
+enum GpuFormat {
+	GPU_FORMAT_RGB,
+	GPU_FORMAT_RGBA,
+	GPU_FORMAT_PLANAR
+};
+
+// How GL errors are checked while capturing frames. Initialization is always checked after every call.
+enum GlValidation {
+	// No checks.
+	GL_VALIDATION_OFF,
+	// One glGetError() per frame.
+	GL_VALIDATION_FRAME,
+	// glGetError() after every call, plus KHR_debug error messages where available.
+	GL_VALIDATION_VERBOSE
+};
+
+// Encoder settings presets, each field can be overridden in the init params.
+enum EncoderPreset {
+	ENCODER_PRESET_REALTIME_LOW_CPU,
+	ENCODER_PRESET_BALANCED,
+	ENCODER_PRESET_ARCHIVAL_QUALITY
+};
+
+// Rate control modes.
+enum RateControl {
+	RATE_CONTROL_VBR = VPX_VBR,
+	RATE_CONTROL_CBR = VPX_CBR
+};
+
+struct EncoderSettings {
+	int threads;
+	int rate_control;
+	int min_quantizer;
+	int max_quantizer;
+	// Rate control buffer sizes, in milliseconds of bitrate.
+	int buffer_initial_size;
+	int buffer_optimal_size;
+	int buffer_size;
+	// Buffer fullness in percent under which rate control drops frames, 0 never drops them.
+	int drop_frame_threshold;
+	// Number of token partitions: 1, 2, 4 or 8. Partitions are coded in parallel by the encoder threads.
+	int token_partitions;
+	// Initial and lowest VP8 speed of the encoder speed governor.
+	int encoder_speed;
+	int min_encoder_speed;
+};
+
+// Fill the settings of a preset, threads and token partitions are derived from the number of CPU cores.
+void get_encoder_preset(int preset, EncoderSettings *settings);
+
+// Shader program of the YUV conversion with its uniform locations and the last uniform values set on it.
+struct YuvProgram {
+	GLuint program;
+	GLint scale_uniform;
+	GLint resolution_uniform;
+	GLfloat scale[2];
+	GLfloat resolution[2];
+};
+
+// Area of the video frame with its own quality, in pixels from the top left corner of the frame.
+struct QualityRegion {
+	int x;
+	int y;
+	int width;
+	int height;
+	// Quantizer delta from -63 to 63, positive values spend more bits on the region.
+	int quality;
+};
+
+static const int MAX_REGIONS = 16;
+
+// Encode time histogram buckets, each one twice as long as the previous: under 1 ms, 1 to 2 ms, ... 64 ms and more.
+static const int ENCODE_TIME_BUCKETS = 8;
+
+// Encoder resolution change, the timestamp is in milliseconds of the video.
+struct ResolutionChange {
+	int64_t timestamp;
+	int width;
+	int height;
+};
+
+// Number of the latest resolution changes kept in the stats.
+static const int MAX_RESOLUTION_CHANGES = 32;
 
 struct CaptureParams {
 	char *filename;
@@ -47,11 +143,95 @@ struct CaptureParams {
 	int *bitrate;
 	int *iframe;
 	int *fps;
+	bool *variable_frame_rate;
+	bool *skip_static_frames;
+	bool *temporal_layers;
 	double *duration;
+	// Memory the replay buffer may grow to, in megabytes.
+	double *replay_memory_limit;
+	// File the replay buffer is memory-mapped from, replay_memory_limit is its size. NULL keeps frames on the heap.
+	char *replay_file;
 	double *x_scale;
 	double *y_scale;
 	int texture_id;
 	bool *async_encoding;
+	int *conversion;
+	int *queue_size;
+	int *queue_policy;
+	int *pbo_count;
+	int *gl_validation;
+	// Average encode time per frame the encoder speed is adjusted to, in milliseconds.
+	double *encode_budget;
+	int *preset;
+	int *threads;
+	int *rate_control;
+	int *min_quantizer;
+	int *max_quantizer;
+	int *buffer_initial_size;
+	int *buffer_optimal_size;
+	int *buffer_size;
+	int *drop_frame_threshold;
+	int *token_partitions;
+	int *encoder_speed;
+	int *min_encoder_speed;
+	// Raw frames supplied from CPU memory.
+	int *source_width;
+	int *source_height;
+	int *source_stride;
+	int *source_format;
+	bool is_headless;
+};
+
+// Recording parameters the GL targets, readback buffers, frame pool and encoder are created for. Resources are reused
+// while the key stays the same.
+struct ResourceKey {
+	int width;
+	int height;
+	int fps;
+	int bitrate;
+	int iframe;
+	bool temporal_layers;
+	int preset;
+	EncoderSettings settings;
+	int conversion;
+	int pbo_count;
+	int texture_id;
+	bool is_headless;
+	bool async_encoding;
+	int queue_size;
+};
+
+// Recording statistics, times are in microseconds.
+struct Stats {
+	int conversion;
+	const char *cpu_kernel;
+	const char *readback;
+	const char *gpu_format;
+	uint64_t readback_time;
+	uint32_t readback_frames;
+	uint64_t gpu_conversion_time;
+	uint32_t gpu_conversion_frames;
+	uint64_t cpu_conversion_time;
+	uint32_t cpu_conversion_frames;
+	uint32_t queue_depth;
+	uint32_t queue_max_depth;
+	uint32_t dropped_frames;
+	uint32_t not_ready_frames;
+	uint32_t decimated_frames;
+	uint32_t static_frames;
+	uint32_t layer_dropped_frames;
+	// Memory allocated by the replay buffer now and at most in the recording, in bytes.
+	uint64_t replay_memory;
+	uint64_t replay_peak_memory;
+	int encoder_speed;
+	uint32_t encode_time;
+	uint32_t encode_time_histogram[ENCODE_TIME_BUCKETS];
+	int encoder_width;
+	int encoder_height;
+	// Latest resolution changes, oldest first, and the number of all changes in the recording.
+	ResolutionChange resolution_changes[MAX_RESOLUTION_CHANGES];
+	int resolution_change_count;
+	uint32_t total_resolution_changes;
 };
 
 class ScreenRecorder {
@@ -61,37 +241,173 @@ private:
 	#endif
 	GLuint scaled_texture;
 	GLuint shader_program;
+	GLuint packed_shader_program;
+	GLuint luma_shader_program;
+	GLuint chroma_shader_program;
+	YuvProgram yuv_program;
+	YuvProgram chroma_program;
 	GLuint vertex_buffer;
-	GLint position_attrib;
-	GLint texcoord_attrib;
-	GLint tex_uniform;
-	GLint scale_uniform;
-	GLint resolution_uniform;
+	// Vertex array object with the quad model's attributes, 0 if not available.
+	GLuint vertex_array;
 	GLuint fbo;
-	GLuint pbo[3];
-	int pbo_index;
-	bool is_pbo_full;
+	// Half resolution U and V targets of the planar GPU conversion.
+	GLuint chroma_fbo;
+	GLuint u_texture;
+	GLuint v_texture;
+	// Per macroblock change mask of the planar GPU conversion, one R8 texel per 16x16 block of the Y, U and V planes
+	// compared against the previous frame's planes.
+	GLuint active_map_shader_program;
+	YuvProgram active_map_program;
+	GLuint active_map_fbo;
+	GLuint active_map_texture;
+	GLuint previous_planes_texture;
+	bool is_active_map;
+	bool is_previous_planes_valid;
+	int active_map_cols;
+	int active_map_rows;
+	// Render thread sequence of frames with a mask and the last one the encoder has taken as reference.
+	uint32_t active_map_id;
+	uint32_t encoded_active_map_id;
+	// Whether the last encoded frame updated the encoder's last frame reference.
+	bool is_last_frame_reference;
+	GLuint source_fbo;
+	GLint source_texture_width;
+	GLint source_texture_height;
+	// Ring of Pixel Buffer Objects for asynchronous readback. Not available on HTML5.
+	GLuint *pbo;
+	int *pbo_conversion;
+	int64_t *pbo_timestamps;
+	uint32_t *pbo_active_map_ids;
+	bool *pbo_active_map_valid;
+	#ifndef DM_PLATFORM_HTML5
+		GLsync *pbo_fences;
+		GLubyte **pbo_pointers;
+		bool is_fence_available;
+		bool is_persistent_mapping;
+	#endif
+	int pbo_count;
+	int pbo_head;
+	int pbo_pending;
+	int conversion;
+	int gpu_format;
+	int calibration_frame;
+	int gl_validation;
+	bool is_gl_recheck;
+	bool is_debug_output;
 	vpx_image_t image;
 	vpx_codec_enc_cfg_t encoder_config;
 	vpx_codec_ctx_t codec;
 	int frame_count;
+	// Timestamps are in milliseconds from the first captured frame.
+	uint64_t first_frame_time;
+	int64_t last_timestamp;
+	// Frame decimation schedule, in microseconds.
+	uint64_t frame_interval;
+	uint64_t next_frame_time;
+	// Static frame detection runs where frames are encoded.
+	uint64_t frame_hash;
+	bool has_frame_hash;
+	int64_t static_end_timestamp;
+	thread_atomic_int_t static_frames;
+	// Encoded frames alternate between the base layer and the enhancement layer, which nothing references.
+	uint32_t layer_frame_count;
+	thread_atomic_int_t layer_dropped_frames;
+	// Quality regions are set from the script and turned into the encoder's ROI map where frames are encoded.
+	QualityRegion regions[MAX_REGIONS];
+	int region_count;
+	thread_mutex_t regions_mutex;
+	thread_atomic_int_t is_roi_map_changed;
+	uint8_t *roi_map;
+	// Encoder load governor, runs where frames are encoded. Average encode time is in microseconds.
+	uint64_t average_encode_time;
+	// Frames encoded since the last speed or scale change.
+	int adjustment_frames;
+	thread_atomic_int_t encoder_speed;
+	// Internal resolution of the encoder, a VPX_SCALING mode applied to both dimensions.
+	thread_atomic_int_t encoder_scale;
+	// Active map reduced to the scaled encoder's macroblocks.
+	uint8_t *scaled_active_map;
+	thread_mutex_t resolution_changes_mutex;
+	ResolutionChange resolution_changes[MAX_RESOLUTION_CHANGES];
+	uint32_t resolution_change_count;
+	thread_atomic_int_t encode_time;
+	thread_atomic_int_t encode_time_histogram[ENCODE_TIME_BUCKETS];
 	CircularBuffer *circular_buffer;
+	// Replay buffer memory in kilobytes, updated where frames are encoded.
+	thread_atomic_int_t replay_memory;
+	thread_atomic_int_t replay_peak_memory;
 	WebmWriter webm_writer;
+	YuvConverter yuv_converter;
+	YuvConverter texture_yuv_converter;
+	FramePool frame_pool;
+	EncodeQueue encode_queue;
 	thread_ptr_t encoding_thread;
 	bool is_initialized;
+	// Resources prepared for the key are kept across recordings.
+	ResourceKey prepared_key;
+	bool is_prepared;
+	bool is_encoder_ready;
+	// A reused encoder needs increasing timestamps, each recording is shifted past the end of the previous one.
+	int64_t pts_offset;
+	int64_t next_pts_offset;
+	bool is_keyframe_forced;
+	void get_resource_key(ResourceKey *key);
+	bool init_gl(char *error_message);
+	bool start_gl(char *error_message);
+	bool create_yuv_targets(char *error_message);
+	void delete_yuv_targets();
+	bool create_active_map_target(char *error_message);
+	bool draw_active_map(char *error_message);
+	int get_active_map_size();
+	int get_frame_size();
+	bool get_program_locations(GLuint program, YuvProgram *yuv, char *error_message);
+	bool set_vertex_attributes(char *error_message);
+	bool set_uniforms(YuvProgram *yuv, char *error_message);
+	bool draw_quad(YuvProgram *yuv, GLuint texture, char *error_message);
+	bool draw_yuv_frame(char *error_message);
+	bool check_frame_gl_error(char *error_message);
+	void set_debug_output(bool is_enabled);
+	void read_yuv_frame(uint8_t *data);
+	void add_readback_time(uint64_t time);
+	#ifndef DM_PLATFORM_HTML5
+		bool create_pixel_buffers(int size, char *error_message);
+		void reset_pixel_buffers();
+		void delete_pixel_buffers();
+		bool is_pixel_buffer_ready(int index);
+		bool read_pixel_buffer(int index, uint8_t **data, char *error_message);
+		void copy_pixel_buffer(int index, const uint8_t *pixels, uint8_t *data);
+	#endif
+	int get_frame_conversion();
+	void add_conversion_time(int frame_conversion, uint64_t time);
+	void set_image_planes(uint8_t *data);
+	void convert_frame(YuvConverter *converter, const RawFrame *frame, uint8_t *data);
+	uint8_t *acquire_frame();
+	int64_t get_timestamp();
+	void submit_frame(uint8_t *data, int64_t timestamp);
+	bool is_static_frame();
+	bool is_encoder_behind();
+	uint32_t set_active_map();
+	void set_roi_map();
+	void get_encoder_size(int scale, int *width, int *height);
+	bool set_encoder_speed(int speed);
+	bool set_encoder_scale(int scale, int64_t timestamp);
+	void update_encoder_load(uint64_t time, int64_t timestamp);
+	Stats stats;
 public:
-	bool should_encoding_thread_exit;
-	thread_signal_t encoding_signal;
-	thread_signal_t encoding_done_signal;
-	bool is_enconding_thread_available;
 	CaptureParams capture_params;
 	ScreenRecorder();
 	~ScreenRecorder();
 	bool init(char *error_message);
+	bool prepare(char *error_message);
 	bool start(char *error_message);
 	bool stop(char *error_message);
 	bool capture_frame(char *error_message);
-	bool encode_frame(bool is_flush);
+	bool capture_raw_frame(const RawFrame *frame, char *error_message);
+	bool is_frame_due();
+	bool set_regions(const QualityRegion *regions, int count, char *error_message);
+	bool encode_queued_frame();
+	bool encode_frame(int64_t timestamp, bool is_flush);
+	Stats *get_stats();
 };
 
 #endif
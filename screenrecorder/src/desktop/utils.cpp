@@ -25,13 +25,28 @@ static char *copy_string(const char *source) {
 }
 
 namespace utils {
+	// Monotonic time in microseconds.
 	uint64_t get_time() {
-		#ifdef _SYS_TIME_H_
-			timeval tv;
-			gettimeofday(&tv, 0);
-			return ((uint64_t) tv.tv_sec) * 1000000U + tv.tv_usec;
+		#if defined(DM_PLATFORM_HTML5)
+			return (uint64_t)(emscripten_get_now() * 1000.0);
+		#elif defined(DM_PLATFORM_WINDOWS)
+			static LARGE_INTEGER frequency = {0};
+			if (frequency.QuadPart == 0) {
+				QueryPerformanceFrequency(&frequency);
+			}
+			LARGE_INTEGER counter;
+			QueryPerformanceCounter(&counter);
+			return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000 + counter.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+		#elif defined(__APPLE__)
+			static mach_timebase_info_data_t timebase = {0, 0};
+			if (timebase.denom == 0) {
+				mach_timebase_info(&timebase);
+			}
+			return mach_absolute_time() * timebase.numer / timebase.denom / 1000;
 		#else
-			return 0;
+			timespec ts;
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			return ((uint64_t)ts.tv_sec) * 1000000U + ts.tv_nsec / 1000;
 		#endif
 	}
 
@@ -270,6 +285,16 @@ namespace utils {
 		lua_setfield(L, -2, key);
 	}
 
+	void table_set_integer_field(lua_State *L, const char *key, int value) {
+		lua_pushinteger(L, value);
+		lua_setfield(L, -2, key);
+	}
+
+	void table_set_number_field(lua_State *L, const char *key, double value) {
+		lua_pushnumber(L, value);
+		lua_setfield(L, -2, key);
+	}
+
 	void dispatch_event(lua_State *L, int lua_listener, int lua_script_instance, Event *event) {
 		if (lua_listener == LUA_REFNIL || lua_listener == LUA_NOREF) {
 			return;
@@ -3,8 +3,14 @@
 
 #include <utility>
 
-#if defined(__linux__) || defined(__APPLE__)
-	#include <sys/time.h>
+#if defined(DM_PLATFORM_HTML5)
+	#include <emscripten.h>
+#elif defined(DM_PLATFORM_WINDOWS)
+	#include <Windows.h>
+#elif defined(__APPLE__)
+	#include <mach/mach_time.h>
+#else
+	#include <time.h>
 #endif
 
 #include <dmsdk/sdk.h>
@@ -56,6 +62,11 @@ namespace utils {
 	void table_get_lightuserdata(lua_State *L, const char *key, void **value, void *default_value);
 	void table_get_lightuserdata_not_null(lua_State *L, const char *key, void **value);
 
+	void table_set_string_field(lua_State *L, const char *key, const char *value);
+	void table_set_boolean_field(lua_State *L, const char *key, bool value);
+	void table_set_integer_field(lua_State *L, const char *key, int value);
+	void table_set_number_field(lua_State *L, const char *key, double value);
+
 	void dispatch_event(lua_State *L, int lua_listener, int lua_script_instance, Event *event);
 
 	void add_task(int lua_listener, int lua_script_instance, Event *event);
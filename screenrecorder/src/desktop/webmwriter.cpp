@@ -5,7 +5,8 @@
 
 WebmWriter::WebmWriter() :
 	file(NULL),
-	frame_ns(0),
+	last_timestamp(0),
+	end_timestamp(0),
 	writer(NULL),
 	segment(NULL) {
 }
@@ -14,8 +15,9 @@ WebmWriter::~WebmWriter() {
 	close();
 }
 
-bool WebmWriter::open(const char *filename, int width, int height, int fps) {
-	frame_ns = 1000000000ll / fps;
+bool WebmWriter::open(const char *filename, int width, int height) {
+	last_timestamp = 0;
+	end_timestamp = 0;
 	file = fopen(filename, "wb");
 	if (!file) {
 		return false;
@@ -41,6 +43,10 @@ bool WebmWriter::open(const char *filename, int width, int height, int fps) {
 
 void WebmWriter::close() {
 	if (writer) {
+		// Skipped frames at the end still count towards the length of the video.
+		if (end_timestamp > last_timestamp) {
+			segment->set_duration(end_timestamp);
+		}
 		segment->Finalize();
 		delete segment;
 		delete writer;
@@ -51,8 +57,18 @@ void WebmWriter::close() {
 	}
 }
 
+// Timestamp is in milliseconds.
 bool WebmWriter::write_frame(uint8_t *data, size_t size, int64_t timestamp, bool is_keyframe) {
-	return segment->AddFrame(data, size, 1, timestamp * frame_ns, is_keyframe);
+	last_timestamp = timestamp;
+	return segment->AddFrame(data, size, 1, timestamp * 1000000, is_keyframe);
+}
+
+// Keep showing the last written frame at least until the timestamp, used for frames identical to it that are not
+// written. A following frame ends it anyway, only the end of the video needs the duration. Timestamp is in milliseconds.
+void WebmWriter::extend_last_frame(int64_t timestamp) {
+	if (timestamp > end_timestamp) {
+		end_timestamp = timestamp;
+	}
 }
 
 bool WebmWriter::mux_audio_video(const char *audio_filename, const char *video_filename, const char *filename, char *error_message) {
@@ -126,7 +142,6 @@ bool WebmWriter::mux_audio_video(const char *audio_filename, const char *video_f
 	const double rate = p_video_track->GetFrameRate();
 	if (rate > 0.0) {
 		muxer_video_track->set_frame_rate(rate);
-		frame_ns = 1000000000ll / rate;
 	}
 
 	// AUDIO READER
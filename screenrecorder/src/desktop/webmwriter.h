@@ -9,7 +9,8 @@
 class WebmWriter {
 private:
 	FILE *file;
-	int64_t frame_ns;
+	int64_t last_timestamp;
+	int64_t end_timestamp;
 	mkvmuxer::MkvWriter *writer;
 	mkvmuxer::Segment *segment;
 	const mkvparser::Block *get_block(mkvparser::Segment *parser_segment, const mkvparser::Cluster **cluster, const mkvparser::BlockEntry **block_entry);
@@ -17,9 +18,10 @@ private:
 public:
 	WebmWriter();
 	~WebmWriter();
-	bool open(const char *filename, int width, int height, int fps);
+	bool open(const char *filename, int width, int height);
 	void close();
 	bool write_frame(uint8_t *data, size_t size, int64_t timestamp, bool is_keyframe);
+	void extend_last_frame(int64_t timestamp);
 	bool mux_audio_video(const char *audio_filename, const char *video_filename, const char *filename, char *error_message);
 };
 
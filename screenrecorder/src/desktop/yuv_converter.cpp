@@ -0,0 +1,343 @@
+#if defined(DM_PLATFORM_OSX) || defined(DM_PLATFORM_LINUX) || defined(DM_PLATFORM_WINDOWS) || defined(DM_PLATFORM_HTML5)
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define YUV_SSE2
+	#include <emmintrin.h>
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define AVX2_TARGET
+	#else
+		#define AVX2_TARGET __attribute__((target("avx2")))
+	#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+	#define YUV_NEON
+	#include <arm_neon.h>
+#endif
+
+#include "yuv_converter.h"
+
+// Coefficients of fragment_shader_source in fixed point, scaled by 2^14.
+static const int YUV_SHIFT = 14;
+static const int Y_R = 4899;
+static const int Y_G = 9617;
+static const int Y_B = 1868;
+static const int U_R = -2769;
+static const int U_G = -5423;
+static const int U_B = 8192;
+static const int V_R = 8192;
+static const int V_G = -6865;
+static const int V_B = -1327;
+// Rounding to nearest, as the shader output is rounded when written into the 8 bit texture.
+static const int Y_BIAS = 1 << (YUV_SHIFT - 1);
+// The 0.5 chroma offset (127.5) plus rounding.
+static const int UV_BIAS = 128 << YUV_SHIFT;
+
+// Black color used outside of the scaled image area.
+static const uint8_t BLACK_PIXEL[4] = {0, 0, 0, 255};
+
+// Same scaling as get_pixel() in the shader. Returns -1 if the frame pixel is outside of the source image area.
+static int map_coordinate(int index, int size, int source_size, double scale) {
+	double source = ((index + 0.5) / size - 0.5) / scale + 0.5;
+	if (source < 0.0 || source > 1.0) {
+		return -1;
+	}
+	int source_index = (int)(source * source_size);
+	return source_index < source_size ? source_index : source_size - 1;
+}
+
+// Luma for every pixel of the row, chroma for every other pixel if u and v are not NULL.
+static void convert_row_scalar(const uint8_t *rgba, int width, PixelFormat format, uint8_t *y, uint8_t *u, uint8_t *v) {
+	const int r_index = format == PIXEL_FORMAT_BGRA ? 2 : 0;
+	const int b_index = 2 - r_index;
+	for (int x = 0; x < width; ++x) {
+		const uint8_t *pixel = rgba + 4 * x;
+		int r = pixel[r_index];
+		int g = pixel[1];
+		int b = pixel[b_index];
+		y[x] = (Y_R * r + Y_G * g + Y_B * b + Y_BIAS) >> YUV_SHIFT;
+		if (u != NULL && (x & 1) == 0) {
+			u[x / 2] = (U_R * r + U_G * g + U_B * b + UV_BIAS) >> YUV_SHIFT;
+			v[x / 2] = (V_R * r + V_G * g + V_B * b + UV_BIAS) >> YUV_SHIFT;
+		}
+	}
+}
+
+// Vectorized kernels convert blocks of pixels and leave the remainder of the row to the scalar kernel.
+// Rows always have even width, so chroma of the remainder stays aligned.
+
+#ifdef YUV_SSE2
+
+// Coefficients for one pixel in memory channel order, alpha is ignored.
+static __m128i sse2_coefficients(PixelFormat format, int r, int g, int b) {
+	return format == PIXEL_FORMAT_BGRA ? _mm_setr_epi16(b, g, r, 0, b, g, r, 0) : _mm_setr_epi16(r, g, b, 0, r, g, b, 0);
+}
+
+// Dot products of four pixels with the coefficients, 32 bit results.
+static inline __m128i sse2_dot(__m128i pixels, __m128i coefficients) {
+	const __m128i zero = _mm_setzero_si128();
+	__m128 a = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(pixels, zero), coefficients));
+	__m128 b = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(pixels, zero), coefficients));
+	return _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _mm_castps_si128(_mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+static inline __m128i sse2_scale(__m128i value, __m128i bias) {
+	return _mm_srai_epi32(_mm_add_epi32(value, bias), YUV_SHIFT);
+}
+
+static void convert_row_sse2(const uint8_t *rgba, int width, PixelFormat format, uint8_t *y, uint8_t *u, uint8_t *v) {
+	const __m128i y_coefficients = sse2_coefficients(format, Y_R, Y_G, Y_B);
+	const __m128i u_coefficients = sse2_coefficients(format, U_R, U_G, U_B);
+	const __m128i v_coefficients = sse2_coefficients(format, V_R, V_G, V_B);
+	const __m128i y_bias = _mm_set1_epi32(Y_BIAS);
+	const __m128i uv_bias = _mm_set1_epi32(UV_BIAS);
+	int x = 0;
+	for (; x + 8 <= width; x += 8) {
+		__m128i p0 = _mm_loadu_si128((const __m128i *)(rgba + 4 * x));
+		__m128i p1 = _mm_loadu_si128((const __m128i *)(rgba + 4 * x + 16));
+		__m128i y0 = sse2_scale(sse2_dot(p0, y_coefficients), y_bias);
+		__m128i y1 = sse2_scale(sse2_dot(p1, y_coefficients), y_bias);
+		__m128i y16 = _mm_packs_epi32(y0, y1);
+		_mm_storel_epi64((__m128i *)(y + x), _mm_packus_epi16(y16, y16));
+		if (u != NULL) {
+			// Pixels 0, 2, 4 and 6.
+			__m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(p0), _mm_castsi128_ps(p1), _MM_SHUFFLE(2, 0, 2, 0)));
+			__m128i u32 = sse2_scale(sse2_dot(even, u_coefficients), uv_bias);
+			__m128i v32 = sse2_scale(sse2_dot(even, v_coefficients), uv_bias);
+			__m128i uv16 = _mm_packs_epi32(u32, v32);
+			__m128i uv8 = _mm_packus_epi16(uv16, uv16);
+			int32_t u4 = _mm_cvtsi128_si32(uv8);
+			int32_t v4 = _mm_cvtsi128_si32(_mm_srli_si128(uv8, 4));
+			memcpy(u + x / 2, &u4, 4);
+			memcpy(v + x / 2, &v4, 4);
+		}
+	}
+	if (x < width) {
+		convert_row_scalar(rgba + 4 * x, width - x, format, y + x, u != NULL ? u + x / 2 : NULL, v != NULL ? v + x / 2 : NULL);
+	}
+}
+
+AVX2_TARGET static inline __m256i avx2_coefficients(PixelFormat format, int r, int g, int b) {
+	return format == PIXEL_FORMAT_BGRA ? _mm256_setr_epi16(b, g, r, 0, b, g, r, 0, b, g, r, 0, b, g, r, 0) : _mm256_setr_epi16(r, g, b, 0, r, g, b, 0, r, g, b, 0, r, g, b, 0);
+}
+
+// Dot products of eight pixels, 32 bit results in pixel order.
+AVX2_TARGET static inline __m256i avx2_dot(__m256i pixels, __m256i coefficients) {
+	const __m256i zero = _mm256_setzero_si256();
+	__m256 a = _mm256_castsi256_ps(_mm256_madd_epi16(_mm256_unpacklo_epi8(pixels, zero), coefficients));
+	__m256 b = _mm256_castsi256_ps(_mm256_madd_epi16(_mm256_unpackhi_epi8(pixels, zero), coefficients));
+	return _mm256_add_epi32(_mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0))), _mm256_castps_si256(_mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1))));
+}
+
+AVX2_TARGET static inline __m256i avx2_scale(__m256i value, __m256i bias) {
+	return _mm256_srai_epi32(_mm256_add_epi32(value, bias), YUV_SHIFT);
+}
+
+// Pack eight 32 bit values into 16 bit values.
+AVX2_TARGET static inline __m128i avx2_pack(__m256i value) {
+	return _mm_packs_epi32(_mm256_castsi256_si128(value), _mm256_extracti128_si256(value, 1));
+}
+
+AVX2_TARGET static void convert_row_avx2(const uint8_t *rgba, int width, PixelFormat format, uint8_t *y, uint8_t *u, uint8_t *v) {
+	const __m256i y_coefficients = avx2_coefficients(format, Y_R, Y_G, Y_B);
+	const __m256i u_coefficients = avx2_coefficients(format, U_R, U_G, U_B);
+	const __m256i v_coefficients = avx2_coefficients(format, V_R, V_G, V_B);
+	const __m256i y_bias = _mm256_set1_epi32(Y_BIAS);
+	const __m256i uv_bias = _mm256_set1_epi32(UV_BIAS);
+	// Restores pixel order after in-lane shuffling of even pixels.
+	const __m256i even_order = _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7);
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		__m256i p0 = _mm256_loadu_si256((const __m256i *)(rgba + 4 * x));
+		__m256i p1 = _mm256_loadu_si256((const __m256i *)(rgba + 4 * x + 32));
+		__m128i y0 = avx2_pack(avx2_scale(avx2_dot(p0, y_coefficients), y_bias));
+		__m128i y1 = avx2_pack(avx2_scale(avx2_dot(p1, y_coefficients), y_bias));
+		_mm_storeu_si128((__m128i *)(y + x), _mm_packus_epi16(y0, y1));
+		if (u != NULL) {
+			// Pixels 0, 2, 8, 10 in the low lane and 4, 6, 12, 14 in the high lane.
+			__m256i even = _mm256_castps_si256(_mm256_shuffle_ps(_mm256_castsi256_ps(p0), _mm256_castsi256_ps(p1), _MM_SHUFFLE(2, 0, 2, 0)));
+			__m256i u32 = _mm256_permutevar8x32_epi32(avx2_scale(avx2_dot(even, u_coefficients), uv_bias), even_order);
+			__m256i v32 = _mm256_permutevar8x32_epi32(avx2_scale(avx2_dot(even, v_coefficients), uv_bias), even_order);
+			__m128i uv8 = _mm_packus_epi16(avx2_pack(u32), avx2_pack(v32));
+			_mm_storel_epi64((__m128i *)(u + x / 2), uv8);
+			_mm_storel_epi64((__m128i *)(v + x / 2), _mm_srli_si128(uv8, 8));
+		}
+	}
+	if (x < width) {
+		convert_row_sse2(rgba + 4 * x, width - x, format, y + x, u != NULL ? u + x / 2 : NULL, v != NULL ? v + x / 2 : NULL);
+	}
+}
+
+static bool is_avx2_supported() {
+	#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+		__cpuid(info, 1);
+		// OSXSAVE and AVX, then the OS must preserve YMM registers.
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+	#else
+		return __builtin_cpu_supports("avx2");
+	#endif
+}
+
+#endif
+
+#ifdef YUV_NEON
+
+static inline uint8x8_t neon_dot(int16x8_t r, int16x8_t g, int16x8_t b, int16_t cr, int16_t cg, int16_t cb, int32_t bias) {
+	int32x4_t low = vdupq_n_s32(bias);
+	low = vmlal_n_s16(low, vget_low_s16(r), cr);
+	low = vmlal_n_s16(low, vget_low_s16(g), cg);
+	low = vmlal_n_s16(low, vget_low_s16(b), cb);
+	int32x4_t high = vdupq_n_s32(bias);
+	high = vmlal_n_s16(high, vget_high_s16(r), cr);
+	high = vmlal_n_s16(high, vget_high_s16(g), cg);
+	high = vmlal_n_s16(high, vget_high_s16(b), cb);
+	return vqmovun_s16(vcombine_s16(vshrn_n_s32(low, YUV_SHIFT), vshrn_n_s32(high, YUV_SHIFT)));
+}
+
+static inline int16x8_t neon_widen(uint8x8_t value) {
+	return vreinterpretq_s16_u16(vmovl_u8(value));
+}
+
+static void convert_row_neon(const uint8_t *rgba, int width, PixelFormat format, uint8_t *y, uint8_t *u, uint8_t *v) {
+	int x = 0;
+	for (; x + 16 <= width; x += 16) {
+		uint8x16x4_t pixels = vld4q_u8(rgba + 4 * x);
+		uint8x16_t r = format == PIXEL_FORMAT_BGRA ? pixels.val[2] : pixels.val[0];
+		uint8x16_t g = pixels.val[1];
+		uint8x16_t b = format == PIXEL_FORMAT_BGRA ? pixels.val[0] : pixels.val[2];
+		uint8x8_t y_low = neon_dot(neon_widen(vget_low_u8(r)), neon_widen(vget_low_u8(g)), neon_widen(vget_low_u8(b)), Y_R, Y_G, Y_B, Y_BIAS);
+		uint8x8_t y_high = neon_dot(neon_widen(vget_high_u8(r)), neon_widen(vget_high_u8(g)), neon_widen(vget_high_u8(b)), Y_R, Y_G, Y_B, Y_BIAS);
+		vst1q_u8(y + x, vcombine_u8(y_low, y_high));
+		if (u != NULL) {
+			// Low bytes of 16 bit pairs are the even pixels.
+			int16x8_t even_r = vreinterpretq_s16_u16(vandq_u16(vreinterpretq_u16_u8(r), vdupq_n_u16(0xFF)));
+			int16x8_t even_g = vreinterpretq_s16_u16(vandq_u16(vreinterpretq_u16_u8(g), vdupq_n_u16(0xFF)));
+			int16x8_t even_b = vreinterpretq_s16_u16(vandq_u16(vreinterpretq_u16_u8(b), vdupq_n_u16(0xFF)));
+			vst1_u8(u + x / 2, neon_dot(even_r, even_g, even_b, U_R, U_G, U_B, UV_BIAS));
+			vst1_u8(v + x / 2, neon_dot(even_r, even_g, even_b, V_R, V_G, V_B, UV_BIAS));
+		}
+	}
+	if (x < width) {
+		convert_row_scalar(rgba + 4 * x, width - x, format, y + x, u != NULL ? u + x / 2 : NULL, v != NULL ? v + x / 2 : NULL);
+	}
+}
+
+#endif
+
+// Pick the widest kernel supported by the CPU.
+static void select_kernel(RowKernel *kernel, const char **name) {
+	#if defined(YUV_SSE2)
+		if (is_avx2_supported()) {
+			*kernel = convert_row_avx2;
+			*name = "avx2";
+		} else {
+			*kernel = convert_row_sse2;
+			*name = "sse2";
+		}
+	#elif defined(YUV_NEON)
+		*kernel = convert_row_neon;
+		*name = "neon";
+	#else
+		*kernel = convert_row_scalar;
+		*name = "scalar";
+	#endif
+}
+
+YuvConverter::YuvConverter() :
+	width(0),
+	height(0),
+	source_width(0),
+	source_height(0),
+	column_map(NULL),
+	row_map(NULL),
+	row_buffer(NULL),
+	is_direct(false),
+	kernel(convert_row_scalar),
+	kernel_name("scalar") {
+		select_kernel(&kernel, &kernel_name);
+}
+
+YuvConverter::~YuvConverter() {
+	release();
+}
+
+void YuvConverter::release() {
+	delete []column_map;
+	delete []row_map;
+	delete []row_buffer;
+	column_map = NULL;
+	row_map = NULL;
+	row_buffer = NULL;
+}
+
+bool YuvConverter::init(int width, int height, int source_width, int source_height, double x_scale, double y_scale) {
+	release();
+	if (width <= 0 || height <= 0 || source_width <= 0 || source_height <= 0 || x_scale <= 0.0 || y_scale <= 0.0) {
+		return false;
+	}
+	this->width = width;
+	this->height = height;
+	this->source_width = source_width;
+	this->source_height = source_height;
+	column_map = new int[width];
+	row_map = new int[height];
+	row_buffer = new uint8_t[4 * width];
+	is_direct = width == source_width && height == source_height;
+	for (int x = 0; x < width; ++x) {
+		column_map[x] = map_coordinate(x, width, source_width, x_scale);
+		is_direct = is_direct && column_map[x] == x;
+	}
+	for (int y = 0; y < height; ++y) {
+		row_map[y] = map_coordinate(y, height, source_height, y_scale);
+		is_direct = is_direct && row_map[y] == y;
+	}
+	return true;
+}
+
+// Returns a contiguous row of frame pixels. Reads caller's memory directly when no scaling is needed.
+const uint8_t *YuvConverter::get_row(const RawFrame *frame, int y) {
+	int source_y = row_map[y];
+	if (is_direct) {
+		return frame->pixels + (ptrdiff_t)source_y * frame->stride;
+	}
+	if (source_y < 0) {
+		for (int x = 0; x < width; ++x) {
+			memcpy(row_buffer + 4 * x, BLACK_PIXEL, 4);
+		}
+		return row_buffer;
+	}
+	const uint8_t *source_row = frame->pixels + (ptrdiff_t)source_y * frame->stride;
+	for (int x = 0; x < width; ++x) {
+		int source_x = column_map[x];
+		memcpy(row_buffer + 4 * x, source_x >= 0 ? source_row + 4 * source_x : BLACK_PIXEL, 4);
+	}
+	return row_buffer;
+}
+
+const char *YuvConverter::get_kernel_name() {
+	return kernel_name;
+}
+
+void YuvConverter::convert(const RawFrame *frame, uint8_t *y_plane, uint8_t *u_plane, uint8_t *v_plane) {
+	const int chroma_width = width / 2;
+	for (int y = 0; y < height; y += 2) {
+		// Chroma is taken from the even rows, one sample per 2x2 block like in the shader.
+		kernel(get_row(frame, y), width, frame->format, y_plane + y * width, u_plane + (y / 2) * chroma_width, v_plane + (y / 2) * chroma_width);
+		if (y + 1 < height) {
+			kernel(get_row(frame, y + 1), width, frame->format, y_plane + (y + 1) * width, NULL, NULL);
+		}
+	}
+}
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef yuv_converter_h
+#define yuv_converter_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum PixelFormat {
+	PIXEL_FORMAT_RGBA,
+	PIXEL_FORMAT_BGRA
+};
+
+// Frame supplied from CPU memory. Stride is in bytes, negative stride means rows are stored bottom-up.
+struct RawFrame {
+	const uint8_t *pixels;
+	int width;
+	int height;
+	int stride;
+	PixelFormat format;
+};
+
+// Converts one row of pixels. Chroma is produced for even pixels only and only if u and v are not NULL.
+typedef void (*RowKernel)(const uint8_t *rgba, int width, PixelFormat format, uint8_t *y, uint8_t *u, uint8_t *v);
+
+// CPU counterpart of the YUV fragment shader, converts 32 bit RGB frames into I420 planes.
+// Uses AVX2, SSE2 or NEON kernels when available.
+class YuvConverter {
+private:
+	int width;
+	int height;
+	int source_width;
+	int source_height;
+	int *column_map;
+	int *row_map;
+	uint8_t *row_buffer;
+	bool is_direct;
+	RowKernel kernel;
+	const char *kernel_name;
+	void release();
+	const uint8_t *get_row(const RawFrame *frame, int y);
+public:
+	YuvConverter();
+	~YuvConverter();
+	bool init(int width, int height, int source_width, int source_height, double x_scale, double y_scale);
+	const char *get_kernel_name();
+	void convert(const RawFrame *frame, uint8_t *y_plane, uint8_t *u_plane, uint8_t *v_plane);
+};
+
+#endif
@@ -5,11 +5,15 @@
 
 static const luaL_reg lua_functions[] = {
 	{"init", ScreenRecorder_init},
+	{"prepare", ScreenRecorder_prepare},
 	{"start", ScreenRecorder_start},
 	{"stop", ScreenRecorder_stop},
 	{"mux_audio_video", ScreenRecorder_mux_audio_video},
 	{"capture_frame", ScreenRecorder_capture_frame},
 	{"is_recording", ScreenRecorder_is_recording},
+	{"should_capture_frame", ScreenRecorder_should_capture_frame},
+	{"set_regions", ScreenRecorder_set_regions},
+	{"get_stats", ScreenRecorder_get_stats},
 	{"is_preview_available", ScreenRecorder_is_preview_available},
     {"show_preview", ScreenRecorder_show_preview},
 	{0, 0}
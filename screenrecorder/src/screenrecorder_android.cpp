@@ -400,6 +400,29 @@ int ScreenRecorder_is_recording(lua_State *L) {
 	lua_pushboolean(L, is_recording);
 	return 1;
 }
+
+// Every captured frame is recorded, there is no frame decimation.
+int ScreenRecorder_should_capture_frame(lua_State *L) {
+	lua_pushboolean(L, is_recording);
+	return 1;
+}
+
+// Recording resources are created by the Java part on start.
+int ScreenRecorder_prepare(lua_State *L) {
+	return 0;
+}
+
+// The encoder is configured by the OS, quality regions are not supported.
+int ScreenRecorder_set_regions(lua_State *L) {
+	return 0;
+}
+
+// Recording statistics are only available on desktop.
+int ScreenRecorder_get_stats(lua_State *L) {
+	lua_pushnil(L);
+	return 1;
+}
+
 int ScreenRecorder_is_preview_available(lua_State *L) {
 	lua_pushboolean(L, false);
 	return 1;
@@ -52,6 +52,40 @@ static bool get_render_target_texture_id(void *render_target, int *texture_id) {
 	return true;
 }
 
+static int get_region_field(lua_State *L, int region, const char *key) {
+	lua_getfield(L, -1, key);
+	if (!lua_isnumber(L, -1)) {
+		luaL_error(L, "Region %d property %s is not a number.", region + 1, key);
+	}
+	int value = (int)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+// Parse an array of quality regions, each one is a table with x, y, width, height and quality fields.
+static int get_regions(lua_State *L, int index, QualityRegion *regions) {
+	if (!lua_istable(L, index)) {
+		luaL_error(L, "Regions must be a table.");
+	}
+	int count = lua_objlen(L, index);
+	if (count > MAX_REGIONS) {
+		luaL_error(L, "Too many regions, at most %d are supported.", MAX_REGIONS);
+	}
+	for (int i = 0; i < count; ++i) {
+		lua_rawgeti(L, index, i + 1);
+		if (!lua_istable(L, -1)) {
+			luaL_error(L, "Region %d is not a table.", i + 1);
+		}
+		regions[i].x = get_region_field(L, i, "x");
+		regions[i].y = get_region_field(L, i, "y");
+		regions[i].width = get_region_field(L, i, "width");
+		regions[i].height = get_region_field(L, i, "height");
+		regions[i].quality = get_region_field(L, i, "quality");
+		lua_pop(L, 1);
+	}
+	return count;
+}
+
 static bool check_is_initialized() {
 	if (is_initialized) {
 		return true;
@@ -78,14 +112,59 @@ int ScreenRecorder_init(lua_State *L) {
 	utils::table_get_integer(L, "bitrate", &sr->capture_params.bitrate, 2 * 1024 * 1024);
 	utils::table_get_integer(L, "iframe", &sr->capture_params.iframe, 1);
 	utils::table_get_integer(L, "fps", &sr->capture_params.fps, 30);
+	utils::table_get_boolean(L, "variable_frame_rate", &sr->capture_params.variable_frame_rate, false);
+	utils::table_get_boolean(L, "skip_static_frames", &sr->capture_params.skip_static_frames, false);
+	utils::table_get_boolean(L, "temporal_layers", &sr->capture_params.temporal_layers, false);
 	utils::table_get_double(L, "duration", &sr->capture_params.duration);
+	utils::table_get_double(L, "replay_memory_limit", &sr->capture_params.replay_memory_limit);
+	utils::table_get_string(L, "replay_file", &sr->capture_params.replay_file);
 	utils::table_get_double(L, "x_scale", &sr->capture_params.x_scale, 1.0);
 	utils::table_get_double(L, "y_scale", &sr->capture_params.y_scale, 1.0);
 	utils::table_get_boolean(L, "async_encoding", &sr->capture_params.async_encoding, false);
+	utils::table_get_integer(L, "conversion", &sr->capture_params.conversion, CONVERSION_GPU);
+	utils::table_get_integer(L, "queue_size", &sr->capture_params.queue_size, 3);
+	utils::table_get_integer(L, "queue_policy", &sr->capture_params.queue_policy, QUEUE_POLICY_BLOCK);
+	utils::table_get_integer(L, "pbo_count", &sr->capture_params.pbo_count, 3);
+	#ifdef DM_RELEASE
+		utils::table_get_integer(L, "gl_validation", &sr->capture_params.gl_validation, GL_VALIDATION_OFF);
+	#else
+		utils::table_get_integer(L, "gl_validation", &sr->capture_params.gl_validation, GL_VALIDATION_FRAME);
+	#endif
+	// Half of the frame interval leaves the other half for the game.
+	utils::table_get_double(L, "encode_budget", &sr->capture_params.encode_budget, 500.0 / *sr->capture_params.fps);
+	// Preset fields are defaults for the individual encoder settings.
+	utils::table_get_integer(L, "preset", &sr->capture_params.preset, ENCODER_PRESET_BALANCED);
+	EncoderSettings preset;
+	get_encoder_preset(*sr->capture_params.preset, &preset);
+	utils::table_get_integer(L, "threads", &sr->capture_params.threads, preset.threads);
+	utils::table_get_integer(L, "rate_control", &sr->capture_params.rate_control, preset.rate_control);
+	utils::table_get_integer(L, "min_quantizer", &sr->capture_params.min_quantizer, preset.min_quantizer);
+	utils::table_get_integer(L, "max_quantizer", &sr->capture_params.max_quantizer, preset.max_quantizer);
+	utils::table_get_integer(L, "buffer_initial_size", &sr->capture_params.buffer_initial_size, preset.buffer_initial_size);
+	utils::table_get_integer(L, "buffer_optimal_size", &sr->capture_params.buffer_optimal_size, preset.buffer_optimal_size);
+	utils::table_get_integer(L, "buffer_size", &sr->capture_params.buffer_size, preset.buffer_size);
+	utils::table_get_integer(L, "drop_frame_threshold", &sr->capture_params.drop_frame_threshold, preset.drop_frame_threshold);
+	utils::table_get_integer(L, "token_partitions", &sr->capture_params.token_partitions, preset.token_partitions);
+	utils::table_get_integer(L, "encoder_speed", &sr->capture_params.encoder_speed, preset.encoder_speed);
+	utils::table_get_integer(L, "min_encoder_speed", &sr->capture_params.min_encoder_speed, preset.min_encoder_speed);
+	utils::table_get_integer(L, "source_width", &sr->capture_params.source_width, *sr->capture_params.width);
+	utils::table_get_integer(L, "source_height", &sr->capture_params.source_height, *sr->capture_params.height);
+	utils::table_get_integer(L, "source_stride", &sr->capture_params.source_stride, 4 * *sr->capture_params.source_width);
+	utils::table_get_integer(L, "source_format", &sr->capture_params.source_format, PIXEL_FORMAT_RGBA);
 	utils::table_get_function(L, "listener", &lua_listener, LUA_REFNIL);
-	utils::table_get_lightuserdata_not_null(L, "render_target", &render_target);
+	utils::table_get_lightuserdata(L, "render_target", &render_target);
+	QualityRegion regions[MAX_REGIONS];
+	int region_count = 0;
+	lua_getfield(L, -1, "regions");
+	if (!lua_isnil(L, -1)) {
+		region_count = get_regions(L, lua_gettop(L), regions);
+	}
+	lua_pop(L, 1); // regions.
 	lua_pop(L, 1); // params table.
 
+	// Without a render target frames are supplied from CPU memory with capture_frame(buffer).
+	sr->capture_params.is_headless = render_target == NULL;
+
 	#ifdef DM_PLATFORM_HTML5
 		*sr->capture_params.async_encoding = false;
 	#endif
@@ -110,16 +189,81 @@ int ScreenRecorder_init(lua_State *L) {
 
 	char error_message[utils::ERROR_MESSAGE_MAX];
 
-	bool success = get_render_target_texture_id(render_target, &sr->capture_params.texture_id);
+	int source_format = *sr->capture_params.source_format;
+	int rate_control = *sr->capture_params.rate_control;
+	int min_quantizer = *sr->capture_params.min_quantizer;
+	int max_quantizer = *sr->capture_params.max_quantizer;
+	int token_partitions = *sr->capture_params.token_partitions;
+	int min_encoder_speed = *sr->capture_params.min_encoder_speed;
+
+	bool success = sr->capture_params.is_headless || get_render_target_texture_id(render_target, &sr->capture_params.texture_id);
 	if (!success) {
 		event.is_error = true;
 		event.error_message = "Failed to retrive render target texture id.";
 	} else if (w <= 0 || h <= 0 || (w % 2) != 0 || (h % 2) != 0) {
 		event.is_error = true;
 		event.error_message = "Invalid width and/or height. Must be positive and divisible by two.";
+	} else if (*sr->capture_params.fps < 1 || *sr->capture_params.fps > 1000) {
+		// Frame durations are whole milliseconds.
+		event.is_error = true;
+		event.error_message = "Invalid fps. Must be from 1 to 1000.";
+	} else if (*sr->capture_params.conversion < CONVERSION_AUTO || *sr->capture_params.conversion > CONVERSION_GPU_RGBA) {
+		event.is_error = true;
+		event.error_message = "Invalid conversion.";
+	} else if (*sr->capture_params.queue_size < 1) {
+		event.is_error = true;
+		event.error_message = "Invalid queue_size. Must be positive.";
+	} else if (*sr->capture_params.queue_policy < QUEUE_POLICY_BLOCK || *sr->capture_params.queue_policy > QUEUE_POLICY_DROP_OLDEST) {
+		event.is_error = true;
+		event.error_message = "Invalid queue_policy.";
+	} else if (*sr->capture_params.pbo_count < 1) {
+		event.is_error = true;
+		event.error_message = "Invalid pbo_count. Must be positive.";
+	} else if (*sr->capture_params.gl_validation < GL_VALIDATION_OFF || *sr->capture_params.gl_validation > GL_VALIDATION_VERBOSE) {
+		event.is_error = true;
+		event.error_message = "Invalid gl_validation.";
+	} else if (*sr->capture_params.encode_budget <= 0.0) {
+		event.is_error = true;
+		event.error_message = "Invalid encode_budget. Must be positive.";
+	} else if (*sr->capture_params.preset < ENCODER_PRESET_REALTIME_LOW_CPU || *sr->capture_params.preset > ENCODER_PRESET_ARCHIVAL_QUALITY) {
+		event.is_error = true;
+		event.error_message = "Invalid preset.";
+	} else if (*sr->capture_params.threads < 1 || *sr->capture_params.threads > 64) {
+		event.is_error = true;
+		event.error_message = "Invalid threads. Must be from 1 to 64.";
+	} else if (rate_control != RATE_CONTROL_VBR && rate_control != RATE_CONTROL_CBR) {
+		event.is_error = true;
+		event.error_message = "Invalid rate_control.";
+	} else if (min_quantizer < 0 || max_quantizer > 63 || min_quantizer > max_quantizer) {
+		event.is_error = true;
+		event.error_message = "Invalid min_quantizer and/or max_quantizer. Must be from 0 to 63, min_quantizer not above max_quantizer.";
+	} else if (*sr->capture_params.buffer_initial_size <= 0 || *sr->capture_params.buffer_optimal_size <= 0 || *sr->capture_params.buffer_size <= 0) {
+		event.is_error = true;
+		event.error_message = "Invalid buffer_initial_size, buffer_optimal_size and/or buffer_size. Must be positive.";
+	} else if (*sr->capture_params.drop_frame_threshold < 0 || *sr->capture_params.drop_frame_threshold > 100) {
+		event.is_error = true;
+		event.error_message = "Invalid drop_frame_threshold. Must be from 0 to 100.";
+	} else if (token_partitions != 1 && token_partitions != 2 && token_partitions != 4 && token_partitions != 8) {
+		event.is_error = true;
+		event.error_message = "Invalid token_partitions. Must be 1, 2, 4 or 8.";
+	} else if (min_encoder_speed < 1 || *sr->capture_params.encoder_speed < min_encoder_speed || *sr->capture_params.encoder_speed > 16) {
+		event.is_error = true;
+		event.error_message = "Invalid encoder_speed and/or min_encoder_speed. Must be from 1 to 16, min_encoder_speed not above encoder_speed.";
+	} else if (*sr->capture_params.source_width <= 0 || *sr->capture_params.source_height <= 0) {
+		event.is_error = true;
+		event.error_message = "Invalid source_width and/or source_height. Must be positive.";
+	} else if (source_format != PIXEL_FORMAT_RGBA && source_format != PIXEL_FORMAT_BGRA) {
+		event.is_error = true;
+		event.error_message = "Invalid source_format.";
 	} else if (sr->capture_params.duration != NULL && *sr->capture_params.duration < 5.0) {
 		event.is_error = true;
 		event.error_message = "Too small duration, must be at least 5 seconds.";
+	} else if (sr->capture_params.replay_memory_limit != NULL && *sr->capture_params.replay_memory_limit <= 0.0) {
+		event.is_error = true;
+		event.error_message = "Invalid replay_memory_limit. Must be positive.";
+	} else if (!sr->set_regions(regions, region_count, error_message)) {
+		event.is_error = true;
+		event.error_message = error_message;
 	} else if (!sr->init(error_message)) {
 		event.is_error = true;
 		event.error_message = error_message;
@@ -130,12 +274,45 @@ int ScreenRecorder_init(lua_State *L) {
 	return 0;
 }
 
+// The encoder of the previous recording is reused, it must be flushed before the next start.
+static void wait_stop_thread() {
+	if (stop_thread != NULL) {
+		thread_join(stop_thread);
+		thread_destroy(stop_thread);
+		stop_thread = NULL;
+	}
+}
+
+int ScreenRecorder_prepare(lua_State *L) {
+	utils::check_arg_count(L, 0);
+	if (!check_is_initialized()) {
+		return 0;
+	}
+	if (!is_recording) {
+		wait_stop_thread();
+		char prepare_error_message[utils::ERROR_MESSAGE_MAX];
+		if (!sr->prepare(prepare_error_message)) {
+			char error_message[utils::ERROR_MESSAGE_MAX];
+			ERROR_MESSAGE("Failed to prepare video recording: %s", prepare_error_message);
+			utils::Event event = {
+				.name = SCREENRECORDER,
+				.phase = EVENT_INIT,
+				.is_error = true,
+				.error_message = error_message
+			};
+			utils::dispatch_event(L, *lua_listener, lua_script_instance, &event);
+		}
+	}
+	return 0;
+}
+
 int ScreenRecorder_start(lua_State *L) {
 	utils::check_arg_count(L, 0);
 	if (!check_is_initialized()) {
 		return 0;
 	}
 	if (!is_recording) {
+		wait_stop_thread();
 		char start_error_message[utils::ERROR_MESSAGE_MAX];
 		bool success = sr->start(start_error_message);
 		if (success) {
@@ -176,10 +353,7 @@ int ScreenRecorder_stop(lua_State *L) {
 	utils::check_arg_count(L, 0);
 	if (is_recording) {
 		if (is_threading_available) {
-			if (stop_thread != NULL) {
-				thread_join(stop_thread);
-				thread_destroy(stop_thread);
-			}
+			wait_stop_thread();
 			stop_thread = thread_create(stop_thread_proc, NULL, "Stop recording thread", THREAD_STACK_SIZE_DEFAULT);
 		} else {
 			stop_thread_proc(NULL);
@@ -230,11 +404,42 @@ int ScreenRecorder_mux_audio_video(lua_State *L) {
 	return 0;
 }
 
+// Wrap buffer's memory into a raw frame, the pixels are not copied.
+static bool get_buffer_frame(lua_State *L, int index, RawFrame *frame, char *error_message) {
+	dmBuffer::HBuffer buffer = dmScript::CheckBuffer(L, index)->m_Buffer;
+	uint8_t *bytes = NULL;
+	uint32_t size = 0;
+	if (dmBuffer::GetBytes(buffer, (void **)&bytes, &size) != dmBuffer::RESULT_OK) {
+		ERROR_MESSAGE("Could not get buffer bytes.");
+		return false;
+	}
+	frame->width = *sr->capture_params.source_width;
+	frame->height = *sr->capture_params.source_height;
+	frame->stride = *sr->capture_params.source_stride;
+	frame->format = (PixelFormat)*sr->capture_params.source_format;
+	size_t row_size = frame->stride < 0 ? -frame->stride : frame->stride;
+	if (row_size * (frame->height - 1) + 4 * frame->width > size) {
+		ERROR_MESSAGE("Buffer is too small, got %u bytes for %dx%d frame with stride %d.", size, frame->width, frame->height, frame->stride);
+		return false;
+	}
+	// Negative stride starts from the last row in memory.
+	frame->pixels = frame->stride < 0 ? bytes + row_size * (frame->height - 1) : bytes;
+	return true;
+}
+
 int ScreenRecorder_capture_frame(lua_State *L) {
-	utils::check_arg_count(L, 0);
+	utils::check_arg_count(L, 0, 1);
 	if (is_recording) {
 		char capture_frame_error_message[utils::ERROR_MESSAGE_MAX];
-		bool success = sr->capture_frame(capture_frame_error_message);
+		bool success = false;
+		if (lua_gettop(L) == 1) {
+			RawFrame frame;
+			success = get_buffer_frame(L, 1, &frame, capture_frame_error_message) && sr->capture_raw_frame(&frame, capture_frame_error_message);
+		} else if (sr->capture_params.is_headless) {
+			snprintf(capture_frame_error_message, utils::ERROR_MESSAGE_MAX, "A buffer argument is required when recording without a render target.");
+		} else {
+			success = sr->capture_frame(capture_frame_error_message);
+		}
 		if (!success) {
 			char error_message[utils::ERROR_MESSAGE_MAX];
 			ERROR_MESSAGE("Failed to capture video frame: %s", capture_frame_error_message);
@@ -256,6 +461,75 @@ int ScreenRecorder_is_recording(lua_State *L) {
 	return 1;
 }
 
+int ScreenRecorder_should_capture_frame(lua_State *L) {
+	utils::check_arg_count(L, 0);
+	lua_pushboolean(L, is_recording && sr->is_frame_due());
+	return 1;
+}
+
+int ScreenRecorder_set_regions(lua_State *L) {
+	utils::check_arg_count(L, 1);
+	if (!check_is_initialized()) {
+		return 0;
+	}
+	QualityRegion regions[MAX_REGIONS];
+	int region_count = get_regions(L, 1, regions);
+	char error_message[utils::ERROR_MESSAGE_MAX];
+	if (!sr->set_regions(regions, region_count, error_message)) {
+		luaL_error(L, "%s", error_message);
+	}
+	return 0;
+}
+
+int ScreenRecorder_get_stats(lua_State *L) {
+	utils::check_arg_count(L, 0);
+	if (!is_initialized) {
+		lua_pushnil(L);
+		return 1;
+	}
+	Stats *stats = sr->get_stats();
+	lua_newtable(L);
+	utils::table_set_integer_field(L, "conversion", stats->conversion);
+	utils::table_set_string_field(L, "cpu_kernel", stats->cpu_kernel);
+	utils::table_set_string_field(L, "readback", stats->readback);
+	utils::table_set_string_field(L, "gpu_format", stats->gpu_format);
+	utils::table_set_number_field(L, "readback_time", stats->readback_frames > 0 ? stats->readback_time / 1000.0 / stats->readback_frames : 0.0);
+	utils::table_set_integer_field(L, "gpu_conversion_frames", stats->gpu_conversion_frames);
+	utils::table_set_number_field(L, "gpu_conversion_time", stats->gpu_conversion_frames > 0 ? stats->gpu_conversion_time / 1000.0 / stats->gpu_conversion_frames : 0.0);
+	utils::table_set_integer_field(L, "cpu_conversion_frames", stats->cpu_conversion_frames);
+	utils::table_set_number_field(L, "cpu_conversion_time", stats->cpu_conversion_frames > 0 ? stats->cpu_conversion_time / 1000.0 / stats->cpu_conversion_frames : 0.0);
+	utils::table_set_integer_field(L, "queue_depth", stats->queue_depth);
+	utils::table_set_integer_field(L, "queue_max_depth", stats->queue_max_depth);
+	utils::table_set_integer_field(L, "dropped_frames", stats->dropped_frames);
+	utils::table_set_integer_field(L, "not_ready_frames", stats->not_ready_frames);
+	utils::table_set_integer_field(L, "decimated_frames", stats->decimated_frames);
+	utils::table_set_integer_field(L, "static_frames", stats->static_frames);
+	utils::table_set_integer_field(L, "layer_dropped_frames", stats->layer_dropped_frames);
+	utils::table_set_number_field(L, "replay_memory", (double)stats->replay_memory);
+	utils::table_set_number_field(L, "replay_peak_memory", (double)stats->replay_peak_memory);
+	utils::table_set_integer_field(L, "encoder_speed", stats->encoder_speed);
+	utils::table_set_number_field(L, "encode_time", stats->encode_time / 1000.0);
+	lua_newtable(L);
+	for (int i = 0; i < ENCODE_TIME_BUCKETS; ++i) {
+		lua_pushinteger(L, stats->encode_time_histogram[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "encode_time_histogram");
+	utils::table_set_integer_field(L, "encoder_width", stats->encoder_width);
+	utils::table_set_integer_field(L, "encoder_height", stats->encoder_height);
+	utils::table_set_integer_field(L, "total_resolution_changes", stats->total_resolution_changes);
+	lua_newtable(L);
+	for (int i = 0; i < stats->resolution_change_count; ++i) {
+		lua_newtable(L);
+		utils::table_set_integer_field(L, "time", (int)stats->resolution_changes[i].timestamp);
+		utils::table_set_integer_field(L, "width", stats->resolution_changes[i].width);
+		utils::table_set_integer_field(L, "height", stats->resolution_changes[i].height);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "resolution_changes");
+	return 1;
+}
+
 int ScreenRecorder_is_preview_available(lua_State *L) {
 	utils::check_arg_count(L, 0);
 	lua_pushboolean(L, false);
@@ -269,6 +543,72 @@ int ScreenRecorder_show_preview(lua_State *L) {
 
 void ScreenRecorder_initialize(lua_State *L) {
 	sr = new ScreenRecorder();
+
+	lua_getglobal(L, EXTENSION_NAME_STRING);
+
+	// Additional API for desktop - pixel formats of frames from CPU memory.
+
+	lua_pushnumber(L, PIXEL_FORMAT_RGBA);
+	lua_setfield(L, -2, "PIXEL_FORMAT_RGBA");
+
+	lua_pushnumber(L, PIXEL_FORMAT_BGRA);
+	lua_setfield(L, -2, "PIXEL_FORMAT_BGRA");
+
+	// Color conversion backends.
+
+	lua_pushnumber(L, CONVERSION_AUTO);
+	lua_setfield(L, -2, "CONVERSION_AUTO");
+
+	lua_pushnumber(L, CONVERSION_GPU);
+	lua_setfield(L, -2, "CONVERSION_GPU");
+
+	lua_pushnumber(L, CONVERSION_CPU);
+	lua_setfield(L, -2, "CONVERSION_CPU");
+
+	lua_pushnumber(L, CONVERSION_GPU_RGB);
+	lua_setfield(L, -2, "CONVERSION_GPU_RGB");
+
+	lua_pushnumber(L, CONVERSION_GPU_RGBA);
+	lua_setfield(L, -2, "CONVERSION_GPU_RGBA");
+
+	// Encode queue overflow policies.
+
+	lua_pushnumber(L, QUEUE_POLICY_BLOCK);
+	lua_setfield(L, -2, "QUEUE_POLICY_BLOCK");
+
+	lua_pushnumber(L, QUEUE_POLICY_DROP_NEWEST);
+	lua_setfield(L, -2, "QUEUE_POLICY_DROP_NEWEST");
+
+	lua_pushnumber(L, QUEUE_POLICY_DROP_OLDEST);
+	lua_setfield(L, -2, "QUEUE_POLICY_DROP_OLDEST");
+
+	lua_pushnumber(L, GL_VALIDATION_OFF);
+	lua_setfield(L, -2, "GL_VALIDATION_OFF");
+
+	lua_pushnumber(L, GL_VALIDATION_FRAME);
+	lua_setfield(L, -2, "GL_VALIDATION_FRAME");
+
+	lua_pushnumber(L, GL_VALIDATION_VERBOSE);
+	lua_setfield(L, -2, "GL_VALIDATION_VERBOSE");
+
+	// Encoder settings presets and rate control modes.
+
+	lua_pushnumber(L, ENCODER_PRESET_REALTIME_LOW_CPU);
+	lua_setfield(L, -2, "PRESET_REALTIME_LOW_CPU");
+
+	lua_pushnumber(L, ENCODER_PRESET_BALANCED);
+	lua_setfield(L, -2, "PRESET_BALANCED");
+
+	lua_pushnumber(L, ENCODER_PRESET_ARCHIVAL_QUALITY);
+	lua_setfield(L, -2, "PRESET_ARCHIVAL_QUALITY");
+
+	lua_pushnumber(L, RATE_CONTROL_VBR);
+	lua_setfield(L, -2, "RATE_CONTROL_VBR");
+
+	lua_pushnumber(L, RATE_CONTROL_CBR);
+	lua_setfield(L, -2, "RATE_CONTROL_CBR");
+
+	lua_pop(L, 1);
 }
 
 void ScreenRecorder_update(lua_State *L) {
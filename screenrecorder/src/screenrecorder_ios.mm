@@ -66,11 +66,15 @@ static NSString *const EVENT_ERROR_MESSAGE = @"error_message";
 // Each ScreenRecorder_* function invokes corresponding Objective-C object method.
 static ScreenRecorderInterface *sr;
 int ScreenRecorder_init(lua_State *L) {return [sr init_:L];}
+int ScreenRecorder_prepare(lua_State *L) {return [sr prepare:L];}
 int ScreenRecorder_start(lua_State *L) {return [sr start:L];}
 int ScreenRecorder_stop(lua_State *L) {return [sr stop:L];}
 int ScreenRecorder_mux_audio_video(lua_State *L) {return [sr mux_audio_video:L];}
 int ScreenRecorder_capture_frame(lua_State *L) {return [sr capture_frame:L];}
 int ScreenRecorder_is_recording(lua_State *L) {return [sr is_recording:L];}
+int ScreenRecorder_should_capture_frame(lua_State *L) {return [sr should_capture_frame:L];}
+int ScreenRecorder_set_regions(lua_State *L) {return [sr set_regions:L];}
+int ScreenRecorder_get_stats(lua_State *L) {return [sr get_stats:L];}
 int ScreenRecorder_is_preview_available(lua_State *L) {return [sr is_preview_available:L];}
 int ScreenRecorder_show_preview(lua_State *L) {return [sr show_preview:L];}
 
@@ -129,6 +133,36 @@ int ScreenRecorder_show_preview(lua_State *L) {return [sr show_preview:L];}
     return 1;
 }
 
+// screenrecorder.should_capture_frame()
+// Frames are captured by the OS, capture_frame() has nothing to do.
+-(int)should_capture_frame:(lua_State*)L {
+    [Utils checkArgCount:L count:0];
+    lua_pushboolean(L, false);
+    return 1;
+}
+
+// screenrecorder.prepare()
+// Recording resources are managed by the OS.
+-(int)prepare:(lua_State*)L {
+    [Utils checkArgCount:L count:0];
+    return 0;
+}
+
+// screenrecorder.set_regions(regions)
+// The encoder is configured by the OS, quality regions are not supported.
+-(int)set_regions:(lua_State*)L {
+    [Utils checkArgCount:L count:1];
+    return 0;
+}
+
+// screenrecorder.get_stats()
+// Recording statistics are only available on desktop.
+-(int)get_stats:(lua_State*)L {
+    [Utils checkArgCount:L count:0];
+    lua_pushnil(L);
+    return 1;
+}
+
 // screenrecorder.init(params)
 -(int)init_:(lua_State*)L {
 	[Utils checkArgCount:L count:1];
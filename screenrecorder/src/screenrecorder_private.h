@@ -14,11 +14,15 @@
 // The following functions are implemented for each platform.
 // Lua API.
 int ScreenRecorder_init(lua_State *L);
+int ScreenRecorder_prepare(lua_State *L);
 int ScreenRecorder_start(lua_State *L);
 int ScreenRecorder_stop(lua_State *L);
 int ScreenRecorder_mux_audio_video(lua_State *L);
 int ScreenRecorder_capture_frame(lua_State *L);
 int ScreenRecorder_is_recording(lua_State *L);
+int ScreenRecorder_should_capture_frame(lua_State *L);
+int ScreenRecorder_set_regions(lua_State *L);
+int ScreenRecorder_get_stats(lua_State *L);
 int ScreenRecorder_is_preview_available(lua_State *L);
 int ScreenRecorder_show_preview(lua_State *L);
 // Extension lifecycle functions.